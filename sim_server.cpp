@@ -1,33 +1,311 @@
 // sim_server.cpp — Multi-elevator passenger simulation with real stats.
 // Windows build (MinGW):
-//   g++ sim_server.cpp -o sim_server -std=c++17 -lws2_32
+//   g++ -O2 sim_server.cpp -o sim_server -std=c++17 -lws2_32
+// Linux build:
+//   g++ -O2 sim_server.cpp -o sim_server -std=c++17 -pthread
 // Run:
-//   .\sim_server
+//   .\sim_server [--speed N|max] [--seed S] [--dispatch NAME] [--config PATH]
+//                [--floors F] [--cars C] [--capacity K[,K...]]
+//                [--start-floors F[,F...]]
+//                [--port P] [--io epoll|threads] [--http-threads N]
+//                [--workers W] [--queue-depth Q]
+//                [--restore PATH] [--checkpoint PATH]
+//   .\sim_server --batch --days N [building flags as above]
+//                [--journal PATH [--journal-mmap] [--journal-segment-mb M]]
+//                [--restore PATH] [--checkpoint PATH]
+//   .\sim_server --batch --days N --replications R [--threads T] [...]
+//   .\sim_server --replay PATH
+//   .\sim_server --bench fleet|calls
+//   .\sim_server --bench dispatch|json [--days N] [--seed S] [--floors F] [--cars C]
+//   .\sim_server --bench scale [--days N] [--seed S] [--dispatch NAME]
+//   .\sim_server --bench sketch [--seed S]
+//   ./sim_server --bench http [--clients N] [--seconds S] [--io epoll|threads]
+//                             [--pipeline D | --close] [--if-none-match]
+//                             [--workers W] [--queue-depth Q]
+//
+// The building: --floors (default 5, at most 32767), --cars (default 3),
+// --capacity for every car or a comma-separated one per car (default 10),
+// --start-floors for every car or one per car (default: car i on floor
+// i mod F + 1). --config reads the same settings from a file of
+// "name = value" lines (floors, cars, capacity, start-floors, dispatch;
+// '#' comments); flags on the command line override it.
+// --speed sets how many simulated seconds pass per real second (default 1);
+// "max" runs the simulation as fast as the CPU allows.
+// --batch opens no socket: it simulates N days flat out, prints the
+// /stats/daily JSON to stdout and the wall time / event rate to stderr.
+// --replications runs R independent copies of the batch across T threads
+// (default: all cores) and prints the mean and 95% confidence interval of
+// avgWaitSec, avgTripSec and total energy, plus wait and trip percentiles
+// pooled over every replication (their sketches merged).
+// On Linux the HTTP front end is an epoll loop on --http-threads threads
+// (default: all cores); --io threads, and every other platform, use a
+// blocking accept loop handing connections to a pool of --workers threads
+// (default 64). At most --queue-depth accepted connections (default 256)
+// wait for a worker; past that a connection is answered 503 with
+// Retry-After: 1 and closed. While others wait, a keep-alive connection
+// keeps its worker for 250 ms and is then closed (idle) or sent
+// Connection: close (busy), so queued clients get a turn. /state/stream and
+// /state/ws get a thread each, 256 at most; more are refused with 503.
+// --journal appends every spawn, board, alight, departure and arrival of
+// a run started from scratch (not with --restore, whose stats a replay
+// could not rebuild) to PATH as fixed-size binary records (layout below),
+// written from the simulation thread in 4096-record batches; a server
+// also flushes whenever it publishes stats. --journal-segment-mb rotates
+// into PATH.000000, PATH.000001, ... of M MB each; --journal-mmap writes
+// through mmap'ed segments (64 MB unless M is given) instead of stdio.
+// --replay reads a journal back (PATH, or its rotated PATH.000000, ...),
+// mapped and scanned in order, and prints the /stats/daily JSON of the run
+// it recorded, byte for byte what --batch printed, plus the replay rate.
+// --restore starts from a checkpoint instead of an empty building: fleet,
+// passengers aboard and waiting, stats, RNG, pending events and versions,
+// so the run carries on exactly as if it had never stopped (a --batch run
+// continues to the end of day N). The building, dispatcher and seed come
+// from the checkpoint, so --restore refuses --config, --floors, --cars,
+// --capacity, --start-floors, --dispatch and --seed. --checkpoint names
+// the file POST /admin/checkpoint writes; without it a server has no such
+// route. A --batch run saves its final state there.
+// --dispatch picks the car dispatcher: nearest (default), look or eta.
+// --seed fixes the RNG seed (otherwise drawn from random_device and printed
+// to stderr). Simulated time never depends on the wall clock, so the same
+// seed and building flags reproduce a --batch run byte for byte, with or
+// without --replications and for any --threads.
+// --bench runs a microbenchmark and prints a table:
+//   fleet     3/64/1024 cars, --days of seeded traffic: ns per tick
+//             (one wake of the simulation thread) with the cars in Fleet
+//             arrays against the old Elevator structs
+//   calls     nearest hall call lookup, per-floor queue scan vs HallCalls
+//   dispatch  every dispatcher on the same seeded traffic: ns per decision
+//             and the resulting avgWaitSec / avgTripSec
+//   json      /state and /stats/daily serialization and response assembly,
+//             old ostringstream code against JsonWriter/OutBuffer: ns,
+//             MB/s and, in a build with -DSIM_BENCH_ALLOC (which counts
+//             every operator new), heap allocations per response
+//   scale     5/50/300 floors x 3/16/128 cars: events/s, tick time
+//             (p50/p99/max of one wake of the simulation thread) and
+//             what /state and /stats cost after a tick
+//   sketch    wait-time percentile sketch: update cost next to the old
+//             sum + count and to keeping every value, query and merge
+//             cost, and p50/p95/p99 error against exact percentiles
+//   http      (Linux) requests/sec against an in-process server with N
+//             concurrent closed-loop clients (default 1000) on keep-alive
+//             connections, D pipelined requests at a time; --close opens a
+//             new connection per request; --if-none-match makes every
+//             client revalidate with the last ETag it saw. Also reports
+//             how many times the /state body was actually serialized and,
+//             for --io threads, 503s shed and accept queue wait times
 //
 // Endpoints:
-//   GET /state
-//   GET /stats/daily
+//   GET /state        carries a strong ETag; If-None-Match -> 304. The
+//                      body is made once per version: "remainingMs" count
+//                      from its "asOfMs" (simulated ms), and every reply,
+//                      304s included, carries X-Sim-Time-Ms, the simulated
+//                      ms now, so remaining now = remainingMs - (X-Sim-
+//                      Time-Ms - asOfMs). ?since= replies do the same.
+//   GET /state?since=V only the cars changed after version V, where V is
+//                      the "version" of the previous such reply; unknown
+//                      or too old a V gets every car with "full":true
+//   GET /state/stream  Server-Sent Events: "resync" with every car, then a
+//                      "transition" with the changed cars each time a car
+//                      goes Idle/Moving/DoorOpen (same JSON as ?since=)
+//   GET /state/ws      WebSocket (RFC 6455) upgrade; the server sends one
+//                      binary message per fleet change, laid out below
+//   GET /stats/daily   totals and averages, plus p50/p95/p99 "waitSec" and
+//                      "tripSec" overall, per elevator and ("waitSec") per
+//                      hour, from QuantileSketch (within ~3%)
+//   GET /metrics       Prometheus text format: requests and handling-time
+//                      histograms per route, simulation tick time, gMutex
+//                      wait/hold time, passengers waiting up/down,
+//                      connection, stream and worker queue counts
+//   POST /admin/checkpoint  only with --checkpoint: saves the simulation to
+//                      that file (written aside, then renamed over it) and
+//                      replies {"bytes","simSec","stateVersion","ms"}
+//
+// /state/ws messages are little-endian and fixed width, so a client reads
+// fields at known offsets (e.g. a JS DataView) without parsing:
+//   header, 24 bytes:
+//     0  u8   type: 1 = full (every car), 2 = delta (changed cars only)
+//     1  u8   layout version, 2
+//     2  u16  car record count
+//     4  u32  floorCount
+//     8  u64  state version
+//    16  u64  asOfMs: simulated ms the records' remainingMs count from
+//   then one 16-byte record per car:
+//     0  u16  id
+//     2  i16  currentFloor
+//     4  i16  targetFloor
+//     6  i8   direction (+1 up, -1 down, 0 idle)
+//     7  u8   state: 0 Idle, 1 Moving, 2 DoorOpen
+//     8  u16  load
+//    10  u16  capacity
+//    12  u32  remainingMs
+// The first message is always full, and so is any message sent after a
+// slow reader's backlog was dropped. A car keeps the asOfMs of the message
+// that last carried it: a delta leaves the other cars' remainingMs
+// counting from their own, older asOfMs.
+//
+// Journal files are little-endian too: a 64-byte header
+//     0  char[8] magic "SIMJRNL\0"
+//     8  u32  format version, 1
+//    12  u32  record size, 32
+//    16  u32  segment index
+//    20  i32  floorCount, 24 i32 cars, 28 i32 capacity (car 1's)
+//    32  u64  seed
+//    40  char[24] dispatcher name
+//   then 32-byte records in simulated-time order:
+//     0  i64  simulated time, ns
+//     8  u8   kind: 1 spawn, 2 board, 3 alight, 4 depart, 5 arrive;
+//             0 ends the records of an mmap'ed segment
+//    10  u16  car index (id - 1), 0xffff for a spawn
+//    12  i32  floor (depart: the floor left)
+//    16  i32  spawn/board: destination; alight: start floor;
+//             depart: target; arrive: passengers on board
+//    24  f64  board: wait s; alight: s since spawn; depart: travel s;
+//             arrive: energy kWh
 
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <deque>
+#include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <random>
 #include <sstream>
 #include <string>
 #include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <limits>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+#include <new>
+#include <cstdint>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifdef _WIN32
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored instead (net_startup)
+#endif
+#include <fcntl.h>
+#include <cerrno>
+#include <csignal>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unordered_map>
 #endif
 
-using Clock     = std::chrono::steady_clock;
-using TimePoint = Clock::time_point;
+#ifdef _WIN32
+using socket_t = SOCKET;
+const socket_t kInvalidSocket = INVALID_SOCKET;
+inline void close_socket(socket_t s) { closesocket(s); }
+const int kShutdownSend = SD_SEND;
+using PollFd = WSAPOLLFD;
+const short kPollIn = POLLRDNORM;
+inline int poll_sockets(PollFd* fds, size_t n, int timeoutMs) {
+    return WSAPoll(fds, (ULONG)n, timeoutMs);
+}
+#else
+using socket_t = int;
+const socket_t kInvalidSocket = -1;
+inline void close_socket(socket_t s) { close(s); }
+const int kShutdownSend = SHUT_WR;
+using PollFd = pollfd;
+const short kPollIn = POLLIN;
+inline int poll_sockets(PollFd* fds, size_t n, int timeoutMs) {
+    return poll(fds, (nfds_t)n, timeoutMs);
+}
+#endif
+
+// Simulated time: nanoseconds since the start of simulated day 0. It only
+// moves forward when the simulation thread advances the SimPacer.
+struct SimClock {
+    using duration   = std::chrono::nanoseconds;
+    using rep        = duration::rep;
+    using period     = duration::period;
+    using time_point = std::chrono::time_point<SimClock>;
+    static constexpr bool is_steady = true;
+};
+
+using WallClock = std::chrono::steady_clock;
+using TimePoint = SimClock::time_point;
+
+// Maps simulated time onto the wall clock. speed > 0 runs that many
+// simulated seconds per real second; speed == 0 never sleeps and jumps
+// straight to the next event.
+class SimPacer {
+public:
+    explicit SimPacer(double speed = 1.0) { reset(speed); }
+
+    // Simulated time starts at `start` (a restored checkpoint's) now.
+    void reset(double speed, TimePoint start = TimePoint{}) {
+        speed_ = speed;
+        wallStart_ = WallClock::now();
+        if (!unpaced())
+            wallStart_ -= std::chrono::duration_cast<WallClock::duration>(
+                std::chrono::duration<double>(
+                    std::chrono::duration<double>(start.time_since_epoch()).count() / speed_));
+        reached_.store(start.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    bool unpaced() const { return speed_ <= 0.0; }
+
+    // Current simulated time; safe to call from any thread.
+    TimePoint now() const {
+        TimePoint reached{ SimClock::duration(reached_.load(std::memory_order_acquire)) };
+        if (unpaced()) return reached;
+        std::chrono::duration<double> real = WallClock::now() - wallStart_;
+        TimePoint paced{ std::chrono::duration_cast<SimClock::duration>(real * speed_) };
+        return paced > reached ? paced : reached;
+    }
+
+    // Simulation thread: blocks until `t` is due and returns the simulated
+    // time reached (never earlier than `t`).
+    TimePoint sleep_until(TimePoint t) {
+        if (!unpaced()) {
+            std::chrono::duration<double> real(
+                std::chrono::duration<double>(t.time_since_epoch()).count() / speed_);
+            std::this_thread::sleep_until(
+                wallStart_ + std::chrono::duration_cast<WallClock::duration>(real));
+            TimePoint n = now();
+            if (n > t) t = n;
+        }
+        reached_.store(t.time_since_epoch().count(), std::memory_order_release);
+        return t;
+    }
+
+private:
+    double speed_ = 1.0;
+    WallClock::time_point wallStart_;
+    std::atomic<long long> reached_{ 0 };
+};
 
 struct Passenger {
     int startFloor;
@@ -36,26 +314,178 @@ struct Passenger {
     TimePoint created;
 };
 
-enum class ElevatorState { Idle, Moving, DoorOpen };
+enum class ElevatorState : unsigned char { Idle, Moving, DoorOpen };
 
-struct Elevator {
-    int id;
-    int currentFloor;
-    int targetFloor;
-    int direction; // +1 up, -1 down, 0 idle
-    bool doorOpen;
-    ElevatorState state;
-    TimePoint stateEndTime;
+inline int lowest_bit(unsigned long long w) {
+#ifdef _MSC_VER
+    unsigned long i; _BitScanForward64(&i, w); return (int)i;
+#else
+    return __builtin_ctzll(w);
+#endif
+}
+
+inline int highest_bit(unsigned long long w) {
+#ifdef _MSC_VER
+    unsigned long i; _BitScanReverse64(&i, w); return (int)i;
+#else
+    return 63 - __builtin_clzll(w);
+#endif
+}
+
+// Mergeable log-linear histogram (HDR style) of durations, in whole
+// milliseconds: exact below 16 ms, then 16 buckets per power of two, so a
+// reported quantile is within 1/32 of the true value. Fixed size and no
+// allocation; adding one value is a bit scan and an increment, and two
+// sketches merge by adding counts.
+class QuantileSketch {
+public:
+    static const int kSubBits = 4;
+    static const int kSub = 1 << kSubBits;
+    static const int kMaxExp = 24; // 2^25 ms, about 9 hours; longer clamps to the last bucket
+    static const int kBuckets = kSub + (kMaxExp - kSubBits + 1) * kSub;
+
+    void add(double seconds) {
+        unsigned long long ms = seconds > 0 ? (unsigned long long)(seconds * 1000.0 + 0.5) : 0;
+        counts_[bucket(ms)]++;
+        count_++;
+        if (ms > maxMs_) maxMs_ = ms;
+    }
+
+    void merge(const QuantileSketch& other) {
+        for (int b = 0; b < kBuckets; ++b) counts_[b] += other.counts_[b];
+        count_ += other.count_;
+        maxMs_ = std::max(maxMs_, other.maxMs_);
+    }
+
+    unsigned long long count() const { return count_; }
+
+    // Checkpoints: the non-empty buckets only, as (index, count) pairs.
+    template <class Out>
+    void save(Out& out) const {
+        std::uint32_t used = 0;
+        for (int b = 0; b < kBuckets; ++b) used += counts_[b] != 0;
+        out.pod(count_).pod(maxMs_).pod(used);
+        for (int b = 0; b < kBuckets; ++b)
+            if (counts_[b]) out.pod((std::uint16_t)b).pod(counts_[b]);
+    }
+
+    template <class In>
+    bool load(In& in) {
+        *this = QuantileSketch{};
+        std::uint32_t used = 0;
+        if (!in.pod(count_).pod(maxMs_).pod(used).ok() || used > (std::uint32_t)kBuckets)
+            return in.fail();
+        for (std::uint32_t i = 0; i < used; ++i) {
+            std::uint16_t b = 0;
+            if (!in.pod(b).ok() || b >= kBuckets || !in.pod(counts_[b]).ok()) return in.fail();
+        }
+        return true;
+    }
+
+    // Smallest value with at least q of all values at or below it (nearest
+    // rank), as the middle of its bucket; 0 when empty.
+    double quantile(double q) const {
+        if (count_ == 0) return 0.0;
+        unsigned long long rank = (unsigned long long)std::ceil(q * count_);
+        if (rank < 1) rank = 1;
+        unsigned long long seen = 0;
+        int b = 0;
+        for (; b < kBuckets - 1; ++b) {
+            seen += counts_[b];
+            if (seen >= rank) break;
+        }
+        return std::min(midpoint_ms(b), (double)maxMs_) / 1000.0;
+    }
+
+private:
+    static int bucket(unsigned long long ms) {
+        if (ms < (unsigned long long)kSub) return (int)ms;
+        int e = highest_bit(ms);
+        if (e > kMaxExp) return kBuckets - 1;
+        return kSub + (e - kSubBits) * kSub + (int)((ms >> (e - kSubBits)) - kSub);
+    }
 
-    int capacity = 10;
-    std::vector<Passenger> onboard;
+    static double midpoint_ms(int b) {
+        if (b < kSub) return b;
+        int e = (b - kSub) / kSub + kSubBits;
+        int sub = (b - kSub) % kSub;
+        double width = (double)(1ULL << (e - kSubBits));
+        return (kSub + sub) * width + (width - 1) / 2;
+    }
+
+    unsigned counts_[kBuckets] = {};
+    unsigned long long count_ = 0;
+    unsigned long long maxMs_ = 0;
+};
 
-    // per-elevator stats
+// per-elevator stats
+struct ElevatorStats {
     int trips = 0;
     int passengersMoved = 0;
     double energyKWh = 0.0;
     int doorOpenCount = 0;
     int stopCount = 0;
+    QuantileSketch waitSec; // passengers boarding this car
+    QuantileSketch tripSec;
+};
+
+// The cars, structure-of-arrays: index c is car c everywhere. The fields
+// touched on every event are packed in their own arrays; onboard lists and
+// stats counters are kept apart so timer/position scans stay in few cache
+// lines. Doors are open exactly in ElevatorState::DoorOpen.
+struct Fleet {
+    // hot
+    std::vector<TimePoint> stateEndTime;
+    std::vector<ElevatorState> state;
+    std::vector<int> currentFloor;
+    std::vector<int> targetFloor;
+    std::vector<int> direction; // +1 up, -1 down, 0 idle
+
+    // warm
+    std::vector<int> id;
+    std::vector<int> capacity;
+    std::vector<std::vector<Passenger>> onboard;
+
+    // cold
+    std::vector<ElevatorStats> stats;
+    std::vector<unsigned long long> version; // stateVersion of the last visible change
+
+    int size() const { return (int)id.size(); }
+
+    int add(int carId, int floor, int cap, ElevatorState st, TimePoint endTime) {
+        stateEndTime.push_back(endTime);
+        state.push_back(st);
+        currentFloor.push_back(floor);
+        targetFloor.push_back(floor);
+        direction.push_back(0);
+        id.push_back(carId);
+        capacity.push_back(cap);
+        onboard.emplace_back();
+        stats.emplace_back();
+        version.push_back(0);
+        return size() - 1;
+    }
+};
+
+// Future work for the simulation thread. Elevator events fire at the car's
+// stateEndTime; arrival events are candidate passenger arrivals on a floor.
+enum class EventKind { Arrival, Elevator };
+
+struct SimEvent {
+    TimePoint at;
+    EventKind kind;
+    int index;         // floor (Arrival) or car index into Simulation::fleet (Elevator)
+    unsigned long long seq;
+};
+
+// Min-heap order: earliest first; at equal times arrivals run before the
+// cars, then insertion order.
+struct SimEventLater {
+    bool operator()(const SimEvent& a, const SimEvent& b) const {
+        if (a.at != b.at) return a.at > b.at;
+        if (a.kind != b.kind) return a.kind > b.kind;
+        return a.seq > b.seq;
+    }
 };
 
 struct HourlyBucket {
@@ -63,6 +493,7 @@ struct HourlyBucket {
     double energyKWh = 0.0;
     double totalWaitSec = 0.0;
     int waitCount = 0;
+    QuantileSketch waitSec;
 };
 
 struct GlobalStats {
@@ -74,381 +505,4489 @@ struct GlobalStats {
     double totalWaitSec = 0.0;
     double totalTripSec = 0.0;
     int completedTrips = 0;
-};
 
-int gFloors = 5;
-std::vector<Elevator> gElevators;
-std::vector<std::deque<Passenger>> upQ, downQ;
-GlobalStats gStats;
-HourlyBucket gHourly[24];
-std::mutex gMutex;
+    QuantileSketch waitSec;
+    QuantileSketch tripSec;
+};
 
-std::mt19937& rng() {
-    static std::mt19937 gen{ std::random_device{}() };
-    return gen;
-}
+// Floors with waiting passengers, one bit per floor in each direction. Kept
+// in step with upQ/downQ (set on enqueue, cleared when a queue empties) so
+// the nearest call is a find-first-set scan outward from a floor.
+struct HallCalls {
+    std::vector<unsigned long long> up, down;
 
-// timing: 1 floor 7.5s, middle floors 7s, last leg 7.5s
-double travel_time_sec(int floors) {
-    if (floors <= 1) return 7.5;
-    return 7.5 + 7.5 + 7.0 * (floors - 2);
-}
+    void reset(int floors) {
+        up.assign(floors / 64 + 1, 0);
+        down.assign(floors / 64 + 1, 0);
+    }
 
-// fake hour (30 seconds real = 1 hour sim)
-int fake_hour() {
-    auto now = Clock::now().time_since_epoch();
-    long sec = std::chrono::duration_cast<std::chrono::seconds>(now).count();
-    return (sec / 30) % 24;
-}
+    static void set(std::vector<unsigned long long>& bits, int floor, bool on) {
+        unsigned long long m = 1ULL << (floor % 64);
+        if (on) bits[floor / 64] |= m;
+        else bits[floor / 64] &= ~m;
+    }
 
-double spawn_rate_per_min(int h) {
-    if (h >= 7 && h < 10) return 0.25;
-    if (h >= 11 && h < 14) return 0.15;
-    if (h >= 16 && h < 19) return 0.30;
-    return 0.05;
-}
+    unsigned long long any(size_t w) const { return up[w] | down[w]; }
 
-bool should_spawn(double ratePerSec) {
-    std::uniform_real_distribution<double> dist(0.0, 1.0);
-    return dist(rng()) < ratePerSec;
-}
+    // lowest floor >= `floor` with a call, or -1
+    int first_at_or_above(int floor) const {
+        return first_from(up.size(), floor, [this](size_t w) { return any(w); });
+    }
+    // ... with a call in one direction (`bits` is up or down)
+    static int first_at_or_above(const std::vector<unsigned long long>& bits, int floor) {
+        return first_from(bits.size(), floor, [&](size_t w) { return bits[w]; });
+    }
 
-Passenger make_passenger(int floor) {
-    std::uniform_int_distribution<int> dist(1, gFloors);
-    int dest = floor;
-    while (dest == floor) dest = dist(rng());
+    // highest floor <= `floor` with a call, or -1
+    int last_at_or_below(int floor) const {
+        return last_from(floor, [this](size_t w) { return any(w); });
+    }
+    static int last_at_or_below(const std::vector<unsigned long long>& bits, int floor) {
+        return last_from(floor, [&](size_t w) { return bits[w]; });
+    }
 
-    Passenger p;
-    p.startFloor = floor;
-    p.destFloor = dest;
-    p.direction = (dest > floor ? +1 : -1);
-    p.created = Clock::now();
-    return p;
-}
+    // Calls fn(floor) for every floor with a call in either direction.
+    template <class F>
+    void for_each(F&& fn) const {
+        for (size_t w = 0; w < up.size(); ++w)
+            for (unsigned long long bits = any(w); bits; bits &= bits - 1)
+                fn((int)(w * 64) + lowest_bit(bits));
+    }
 
-void generate_traffic() {
-    int h = fake_hour();
-    double rateMin = spawn_rate_per_min(h);
-    double rateSec = rateMin / 60.0;
+    // Closest floor with a call (the lower one on a tie), or -1 if none.
+    int nearest(int floor) const {
+        int below = last_at_or_below(floor);
+        int above = first_at_or_above(floor);
+        if (below < 0) return above;
+        if (above < 0) return below;
+        return (floor - below <= above - floor) ? below : above;
+    }
 
-    for (int f = 1; f <= gFloors; ++f) {
-        if (should_spawn(rateSec)) {
-            Passenger p = make_passenger(f);
-            if (p.direction == +1) upQ[f].push_back(p);
-            else downQ[f].push_back(p);
-            gStats.totalPassengers++;
+private:
+    // Scans the words word(w) (w < words) up from / down from `floor`.
+    template <class Word>
+    static int first_from(size_t words, int floor, Word word) {
+        size_t w = floor / 64;
+        unsigned long long bits = word(w) & (~0ULL << (floor % 64));
+        while (true) {
+            if (bits) return (int)(w * 64) + lowest_bit(bits);
+            if (++w == words) return -1;
+            bits = word(w);
         }
     }
-}
-
-int choose_next_target(const Elevator& e) {
-    if (!e.onboard.empty())
-        return e.onboard.front().destFloor;
+    template <class Word>
+    static int last_from(int floor, Word word) {
+        size_t w = floor / 64;
+        int shift = 63 - floor % 64;
+        unsigned long long bits = word(w) & (~0ULL >> shift);
+        while (true) {
+            if (bits) return (int)(w * 64) + highest_bit(bits);
+            if (w-- == 0) return -1;
+            bits = word(w);
+        }
+    }
+};
 
-    int best = e.currentFloor;
-    int bestDist = 999;
+// What init_building builds (--floors/--cars/--capacity/--start-floors
+// or --config). Per-car lists are empty or hold one entry per car.
+struct BuildingParams {
+    int floors = 5;
+    int cars = 3;
+    int capacity = 10;            // every car's, unless capacities is set
+    std::vector<int> capacities;
+    std::vector<int> startFloors; // empty: car i starts on floor i % floors + 1
+    std::string dispatcher = "nearest";
 
-    for (int f = 1; f <= gFloors; ++f) {
-        if (upQ[f].empty() && downQ[f].empty()) continue;
-        int d = std::abs(f - e.currentFloor);
-        if (d < bestDist) { bestDist = d; best = f; }
+    int capacity_of(int car) const { return capacities.empty() ? capacity : capacities[car]; }
+    int start_floor(int car) const {
+        return startFloors.empty() ? car % floors + 1 : startFloors[car];
     }
-    return best;
-}
+};
 
-void update_elevator(Elevator& e, TimePoint now) {
-    using namespace std::chrono;
+// Append-only binary journal of simulation events (--journal). Every file
+// starts with a 64-byte JournalHeader followed by 32-byte JournalRecords,
+// native (little-endian) layout, so a reader can map a file and index
+// records directly. The simulation thread appends by filling the next slot
+// of a batch buffer (written out with one fwrite when full) or, with
+// --journal-mmap, of the mapped segment itself.
+enum class JournalKind : std::uint8_t {
+    Spawn = 1, // floor = start, aux = destination
+    Board,     // floor, aux = destination, value = wait s
+    Alight,    // floor, aux = start floor, value = s since the passenger appeared
+    Depart,    // floor = from, aux = target, value = travel s
+    Arrive,    // floor, aux = passengers on board, value = energy kWh
+};
 
-    if (e.state == ElevatorState::Idle) {
-        if (now >= e.stateEndTime) {
-            int next = choose_next_target(e);
-            if (next == e.currentFloor) {
-                e.direction = 0;
-                e.stateEndTime = now + seconds(1);
-                return;
-            }
+const std::uint16_t kJournalNoCar = 0xffff; // car of a Spawn
 
-            e.targetFloor = next;
-            int diff = e.targetFloor - e.currentFloor;
-            int floors = std::abs(diff);
+struct JournalRecord {
+    std::int64_t timeNs;   // simulated time
+    std::uint8_t kind;     // JournalKind; 0 marks the unused tail of a segment
+    std::uint8_t reserved;
+    std::uint16_t car;     // index into the fleet (id - 1)
+    std::int32_t floor;
+    std::int32_t aux;
+    std::uint32_t pad;
+    double value;
+};
+static_assert(sizeof(JournalRecord) == 32, "journal records are 32 bytes");
 
-            e.direction = diff > 0 ? +1 : -1;
-            e.doorOpen = false;
-            e.state = ElevatorState::Moving;
+struct JournalHeader {
+    char magic[8];           // "SIMJRNL\0"
+    std::uint32_t version;   // 1
+    std::uint32_t recordSize;
+    std::uint32_t segment;   // index of this file in a rotated journal
+    std::int32_t floors;
+    std::int32_t cars;
+    std::int32_t capacity;
+    std::uint64_t seed;
+    char dispatcher[24];
+};
+static_assert(sizeof(JournalHeader) == 64, "journal header is 64 bytes");
 
-            double tSec = travel_time_sec(floors);
-            e.stateEndTime = now + duration_cast<Clock::duration>(duration<double>(tSec));
+const char kJournalMagic[8] = { 'S', 'I', 'M', 'J', 'R', 'N', 'L', 0 };
 
-            // trip stats
-            gStats.totalTrips++;
-            gStats.completedTrips++;
-            gStats.totalTripSec += tSec;
-            e.trips++;
+struct JournalParams {
+    std::string path;     // empty: no journal
+    bool mmap = false;
+    int segmentMB = 0;    // rotate into path.000000, path.000001, ...; 0: one file
+};
 
-            int h = fake_hour();
-            gHourly[h].trips++;
-        }
-    }
-    else if (e.state == ElevatorState::Moving) {
-        if (now >= e.stateEndTime) {
-            int diff = std::abs(e.targetFloor - e.currentFloor);
-            double tSec = travel_time_sec(diff);
+// File `segment` of a rotated journal at `path`.
+inline std::string journal_segment_path(const std::string& path, unsigned segment) {
+    char suffix[16];
+    std::snprintf(suffix, sizeof(suffix), ".%06u", segment);
+    return path + suffix;
+}
 
-            double loadFactor = 1.0 + 0.05 * e.onboard.size();
-            double energy = 0.05 * diff * loadFactor;
+class Journal {
+public:
+    static const size_t kBatchRecords = 4096;
+    static const int kDefaultMmapSegmentMB = 64;
 
-            gStats.totalEnergyKWh += energy;
-            e.energyKWh += energy;
-            gHourly[fake_hour()].energyKWh += energy;
+    ~Journal() { close(); }
 
-            e.currentFloor = e.targetFloor;
-            e.direction = 0;
-            e.doorOpen = true;
-            e.state = ElevatorState::DoorOpen;
-            e.stateEndTime = now + seconds(5); // doors open/close timing
+    bool open(const JournalParams& jp, const JournalHeader& header) {
+        params_ = jp;
+        header_ = header;
+#ifdef _WIN32
+        if (params_.mmap) {
+            std::cerr << "journal: --journal-mmap is POSIX only, writing buffered\n";
+            params_.mmap = false;
+        }
+#endif
+        if (params_.mmap && params_.segmentMB <= 0) params_.segmentMB = kDefaultMmapSegmentMB;
+        if (params_.segmentMB > 0) {
+            unsigned long long bytes = (unsigned long long)params_.segmentMB << 20;
+            segmentRecords_ = (bytes - sizeof(JournalHeader)) / sizeof(JournalRecord);
+        }
+        batch_.resize(kBatchRecords);
+        return open_segment();
+    }
 
-            e.stopCount++;
-            e.doorOpenCount++;
+    void append(TimePoint t, JournalKind kind, int car, int floor, int aux, double value) {
+        if (next_ == end_) advance();
+        JournalRecord& r = *next_++;
+        r.timeNs = t.time_since_epoch().count();
+        r.kind = (std::uint8_t)kind;
+        r.reserved = 0;
+        r.car = (std::uint16_t)car;
+        r.floor = floor;
+        r.aux = aux;
+        r.pad = 0;
+        r.value = value;
+    }
 
-            // exit
-            auto it = e.onboard.begin();
-            while (it != e.onboard.end()) {
-                if (it->destFloor == e.currentFloor) {
-                    gStats.completedPassengers++;
-                    e.passengersMoved++;
-                    it = e.onboard.erase(it);
-                } else ++it;
-            }
+    // Buffered records reach the file (mapped ones are there already).
+    void flush() {
+        if (params_.mmap || failed_) return;
+        write_batch();
+        std::fflush(file_);
+    }
 
-            // enter
-            int capLeft = e.capacity - (int)e.onboard.size();
-            auto& U = upQ[e.currentFloor];
-            auto& D = downQ[e.currentFloor];
+    void close() {
+        if (file_ || map_) finish_segment();
+    }
 
-            auto board = [&](std::deque<Passenger>& q) {
-                while (capLeft > 0 && !q.empty()) {
-                    Passenger p = q.front(); q.pop_front();
-                    double waitSec = duration<double>(now - p.created).count();
+    unsigned long long records() const {
+        return done_ + (unsigned long long)(next_ - begin_);
+    }
+    int segments() const { return (int)header_.segment + 1; }
+    bool failed() const { return failed_; }
 
-                    gStats.totalWaitSec += waitSec;
-                    int h2 = fake_hour();
-                    gHourly[h2].totalWaitSec += waitSec;
-                    gHourly[h2].waitCount++;
+private:
+    std::string segment_path() const {
+        if (params_.segmentMB <= 0) return params_.path;
+        return journal_segment_path(params_.path, header_.segment);
+    }
 
-                    e.onboard.push_back(p);
-                    capLeft--;
-                }
-            };
+    bool open_segment() {
+        std::string path = segment_path();
+        inSegment_ = 0;
+#ifndef _WIN32
+        if (params_.mmap) {
+            size_t bytes = sizeof(JournalHeader) + segmentRecords_ * sizeof(JournalRecord);
+            fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd_ < 0 || ftruncate(fd_, (off_t)bytes) != 0) return fail(path);
+            void* m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (m == MAP_FAILED) return fail(path);
+            map_ = (char*)m;
+            mapBytes_ = bytes;
+            std::memcpy(map_, &header_, sizeof(header_));
+            begin_ = next_ = (JournalRecord*)(map_ + sizeof(JournalHeader));
+            end_ = begin_ + segmentRecords_;
+            return true;
+        }
+#endif
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_ || std::fwrite(&header_, sizeof(header_), 1, file_) != 1) return fail(path);
+        reset_batch();
+        return true;
+    }
 
-            board(U);
-            board(D);
+    // The batch is full: write it out, or the segment is: start the next.
+    void advance() {
+        if (failed_) { next_ = begin_; return; } // keep the simulation going, drop records
+        if (!params_.mmap) {
+            write_batch();
+            if (segmentRecords_ == 0 || inSegment_ < segmentRecords_) return;
         }
+        finish_segment();
+        header_.segment++;
+        open_segment();
     }
-    else if (e.state == ElevatorState::DoorOpen) {
-        if (now >= e.stateEndTime) {
-            e.doorOpen = false;
-            e.state = ElevatorState::Idle;
-            e.stateEndTime = now + seconds(1);
+
+    void write_batch() {
+        size_t n = (size_t)(next_ - begin_);
+        if (n && std::fwrite(begin_, sizeof(JournalRecord), n, file_) != n) {
+            fail(segment_path());
+            return;
         }
+        done_ += n;
+        inSegment_ += n;
+        reset_batch();
     }
-}
 
-void sim_loop() {
-    while (true) {
-        auto now = Clock::now();
-        {
-            std::lock_guard<std::mutex> lock(gMutex);
-            generate_traffic();
-            for (auto& e : gElevators)
-                update_elevator(e, now);
+    // Next batch, cut short where the segment ends.
+    void reset_batch() {
+        size_t n = kBatchRecords;
+        if (segmentRecords_) n = (size_t)std::min<unsigned long long>(n, segmentRecords_ - inSegment_);
+        begin_ = next_ = batch_.data();
+        end_ = begin_ + n;
+    }
+
+    void finish_segment() {
+        if (map_) {
+#ifndef _WIN32
+            size_t used = (size_t)(next_ - begin_);
+            done_ += used;
+            munmap(map_, mapBytes_);
+            // trim the unused tail so readers see exactly the records written
+            if (ftruncate(fd_, (off_t)(sizeof(JournalHeader) + used * sizeof(JournalRecord))) != 0)
+                std::cerr << "journal: cannot trim " << segment_path() << "\n";
+            ::close(fd_);
+#endif
+            map_ = nullptr;
+            fd_ = -1;
+            begin_ = next_ = end_ = nullptr;
+        } else if (file_) {
+            if (!failed_) write_batch();
+            std::fclose(file_);
+            file_ = nullptr;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
-}
 
-// ✅ UPDATED: /state now includes state + remainingMs
-std::string state_json() {
-    std::lock_guard<std::mutex> lock(gMutex);
-    std::ostringstream out;
+    bool fail(const std::string& path) {
+        if (!failed_)
+            std::cerr << "journal: cannot write " << path << ": " << std::strerror(errno) << "\n";
+        failed_ = true;
+        begin_ = next_ = batch_.data();
+        end_ = begin_ + batch_.size();
+        return false;
+    }
 
-    auto now = Clock::now();
+    JournalParams params_;
+    JournalHeader header_{};
+    std::vector<JournalRecord> batch_;
+    JournalRecord* begin_ = nullptr; // the batch, or the mapped segment's records
+    JournalRecord* next_ = nullptr;
+    JournalRecord* end_ = nullptr;
+    unsigned long long segmentRecords_ = 0; // 0: unlimited
+    unsigned long long inSegment_ = 0;      // records written to the current file
+    unsigned long long done_ = 0;           // records written to finished batches/segments
+    std::FILE* file_ = nullptr;
+    char* map_ = nullptr;
+    size_t mapBytes_ = 0;
+    int fd_ = -1;
+    bool failed_ = false;
+};
 
-    out << "{";
-    out << "\"floorCount\":" << gFloors << ",";
-    out << "\"elevators\":[";
+struct Simulation;
 
-    for (size_t i = 0; i < gElevators.size(); ++i) {
-        const auto& e = gElevators[i];
-        if (i) out << ",";
+// Picks where an idle car goes next. Each Simulation owns its own instance,
+// so a strategy may keep per-car state between decisions.
+class Dispatcher {
+public:
+    virtual ~Dispatcher() = default;
 
-        long long remainingMs =
-            std::chrono::duration_cast<std::chrono::milliseconds>(e.stateEndTime - now).count();
-        if (remainingMs < 0) remainingMs = 0;
+    // Next floor for idle car `c`; returning its current floor keeps it idle.
+    virtual int next_target(const Simulation& sim, int c, TimePoint now) = 0;
 
-        std::string stateStr;
-        switch (e.state) {
-            case ElevatorState::Idle:     stateStr = "Idle"; break;
-            case ElevatorState::Moving:   stateStr = "Moving"; break;
-            case ElevatorState::DoorOpen: stateStr = "DoorOpen"; break;
+    // State kept between decisions, for checkpoints: restore_state gets
+    // back what saved_state returned.
+    virtual std::vector<int> saved_state() const { return {}; }
+    virtual void restore_state(std::vector<int>) {}
+};
+
+// One simulated building: fleet, hall queues, stats, its own RNG stream and
+// event queue. Instances share nothing, so replications can run in parallel.
+struct Simulation {
+    int floors = 5;
+    Fleet fleet;
+    std::vector<std::deque<Passenger>> upQ, downQ;
+    HallCalls calls;
+    GlobalStats stats;
+    HourlyBucket hourly[24];
+    std::mt19937 rng;
+    std::unique_ptr<Dispatcher> dispatcher;
+    std::string dispatcherName; // its dispatcher_registry() name
+    unsigned long long seed = 0; // what rng was seeded from
+
+    std::priority_queue<SimEvent, std::vector<SimEvent>, SimEventLater> events;
+    TimePoint now{};   // time of the last event run
+    unsigned long long eventSeq = 0;
+    unsigned long long eventCount = 0;
+
+    // Bumped by every event that changes what /state or /stats/daily
+    // report; HTTP readers key their response caches on them.
+    unsigned long long stateVersion = 1;
+    unsigned long long statsVersion = 1;
+    TimePoint stateChangedAt{};
+
+    Journal* journal = nullptr; // --journal; not owned
+};
+
+// What an event changed, as returned by floor_arrival and update_elevator.
+enum Changed : unsigned { kChangedNothing = 0, kChangedState = 1, kChangedStats = 2 };
+
+// What one car looks like to HTTP readers.
+struct CarSnapshot {
+    int id;
+    int currentFloor;
+    int targetFloor;
+    int direction;
+    ElevatorState state;
+    int load;
+    int capacity;
+    TimePoint stateEndTime;
+};
+
+// Immutable copy of what /state reports as of one stateVersion, taken when
+// that version was reached. The simulation thread publishes a new one only
+// when the version moves; readers serialize from it without gMutex.
+struct FleetSnapshot {
+    unsigned long long version = 0;
+    TimePoint at;
+    int floors = 0;
+    std::vector<CarSnapshot> cars;
+};
+
+// The same for /stats/daily and statsVersion.
+struct StatsSnapshot {
+    unsigned long long version = 0;
+    int floors = 0;
+    GlobalStats stats;
+    HourlyBucket hourly[24];
+    std::vector<int> ids;
+    std::vector<ElevatorStats> cars;
+    long long waitingUp = 0, waitingDown = 0; // passengers in upQ / downQ
+};
+
+Simulation gSim;   // the building served over HTTP
+std::mutex gMutex; // guards gSim; only the simulation thread takes it
+SimPacer gPacer;
+
+// latest gSim snapshots; read and replace only via std::atomic_load/store
+std::shared_ptr<const FleetSnapshot> gFleetSnapshot;
+std::shared_ptr<const StatsSnapshot> gStatsSnapshot;
+
+// Which car changed at which published stateVersion, oldest first, for
+// /state?since=. Only a car's newest change before each publish is kept,
+// which is all a delta needs. Bounded: a client whose version has fallen
+// out of the log gets a full resync instead.
+class StateLog {
+public:
+    static const size_t kCapacity = 4096;
+
+    // Forgets everything; versions after `version` are logged from now on.
+    void reset(unsigned long long version) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        floor_ = version;
+    }
+
+    void record(unsigned long long version, int car) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.size() == kCapacity) {
+            floor_ = entries_.front().version;
+            entries_.pop_front();
         }
+        entries_.push_back(Entry{ version, car });
+    }
 
-        out << "{"
-            << "\"id\":" << e.id
-            << ",\"currentFloor\":" << e.currentFloor
-            << ",\"targetFloor\":" << e.targetFloor
-            << ",\"direction\":" << e.direction
-            << ",\"doorOpen\":" << (e.doorOpen ? "true" : "false")
-            << ",\"load\":" << e.onboard.size()
-            << ",\"capacity\":" << e.capacity
-            << ",\"state\":\"" << stateStr << "\""
-            << ",\"remainingMs\":" << remainingMs
-            << "}";
+    // Sets changed[car] for every car changed in (since, upTo]. False if
+    // the log no longer reaches back to `since`.
+    bool changed_between(unsigned long long since, unsigned long long upTo,
+                         std::vector<char>& changed) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (since < floor_) return false;
+        for (auto it = entries_.rbegin(); it != entries_.rend() && it->version > since; ++it)
+            if (it->version <= upTo) changed[it->car] = 1;
+        return true;
     }
 
-    out << "]}";
-    return out.str();
-}
+private:
+    struct Entry {
+        unsigned long long version;
+        int car;
+    };
 
-std::string stats_json() {
-    std::lock_guard<std::mutex> lock(gMutex);
+    mutable std::mutex mutex_;
+    std::deque<Entry> entries_;
+    unsigned long long floor_ = 0; // every change after this version is logged
+};
 
-    double avgWait =
-        gStats.completedPassengers > 0
-            ? gStats.totalWaitSec / gStats.completedPassengers
-            : 0.0;
+StateLog gStateLog;
 
-    double avgTrip =
-        gStats.completedTrips > 0
-            ? gStats.totalTripSec / gStats.completedTrips
-            : 0.0;
+// Fans /state/stream messages out to subscribers. Each message is
+// serialized once and every subscriber queue holds the same buffer. A
+// subscriber that falls kQueueLimit messages behind loses its backlog and
+// gets one full resync instead, so a slow reader costs bounded memory.
+class StreamHub {
+public:
+    static const size_t kQueueLimit = 64;
 
-    double avgEnergy =
-        gStats.totalTrips > 0
-            ? gStats.totalEnergyKWh / gStats.totalTrips
-            : 0.0;
+    struct Subscriber {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::shared_ptr<const std::string>> queue;
+        bool resync = true; // a new subscriber starts from the full state
+    };
 
-    int peakHour = 0, maxTrips = 0;
-    for (int h = 0; h < 24; ++h)
-        if (gHourly[h].trips > maxTrips) { maxTrips = gHourly[h].trips; peakHour = h; }
+    std::shared_ptr<Subscriber> subscribe() {
+        auto sub = std::make_shared<Subscriber>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        subs_.push_back(sub);
+        count_.store(subs_.size(), std::memory_order_relaxed);
+        return sub;
+    }
 
-    std::ostringstream out;
-    out << "{";
-    out << "\"floorCount\":" << gFloors << ",";
-    out << "\"totalTrips\":" << gStats.totalTrips << ",";
-    out << "\"totalPassengers\":" << gStats.totalPassengers << ",";
-    out << "\"avgWaitSec\":" << avgWait << ",";
-    out << "\"avgTripSec\":" << avgTrip << ",";
-    out << "\"avgEnergyKWh\":" << avgEnergy << ",";
-    out << "\"peakHour\":" << peakHour << ",";
-
-    out << "\"elevators\":[";
-    for (size_t i = 0; i < gElevators.size(); ++i) {
-        const auto& e = gElevators[i];
-        if (i) out << ",";
-        out << "{"
-            << "\"id\":" << e.id
-            << ",\"trips\":" << e.trips
-            << ",\"passengersMoved\":" << e.passengersMoved
-            << ",\"energyKWh\":" << e.energyKWh
-            << ",\"doorOpenCount\":" << e.doorOpenCount
-            << ",\"stopCount\":" << e.stopCount
-            << "}";
-    }
-    out << "],";
-
-    out << "\"hourly\":[";
-    for (int h = 0; h < 24; ++h) {
-        if (h) out << ",";
-        double hAvgWait =
-            gHourly[h].waitCount > 0
-                ? gHourly[h].totalWaitSec / gHourly[h].waitCount
-                : 0.0;
-        out << "{"
-            << "\"hour\":" << h
-            << ",\"trips\":" << gHourly[h].trips
-            << ",\"avgWaitSec\":" << hAvgWait
-            << ",\"energyKWh\":" << gHourly[h].energyKWh
-            << "}";
+    void unsubscribe(const std::shared_ptr<Subscriber>& sub) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subs_.erase(std::remove(subs_.begin(), subs_.end(), sub), subs_.end());
+        count_.store(subs_.size(), std::memory_order_relaxed);
     }
-    out << "]}";
-    return out.str();
-}
 
-std::string http_ok(const std::string& body) {
-    std::ostringstream out;
-    out << "HTTP/1.1 200 OK\r\n"
-        << "Content-Type: application/json\r\n"
-        << "Content-Length: " << body.size() << "\r\n"
-        << "Connection: close\r\n\r\n"
-        << body;
-    return out.str();
-}
+    // Lets the simulation thread skip serializing when nobody listens.
+    bool has_subscribers() const { return count_.load(std::memory_order_relaxed) > 0; }
+    size_t size() const { return count_.load(std::memory_order_relaxed); }
 
-void handle_client(SOCKET c) {
-    char buf[4096];
-    int n = recv(c, buf, sizeof(buf)-1, 0);
-    if (n <= 0) { closesocket(c); return; }
-    buf[n] = 0;
-    std::string req(buf), resp;
-
-    if (req.find("GET /state") != std::string::npos)
-        resp = http_ok(state_json());
-    else if (req.find("GET /stats") != std::string::npos)
-        resp = http_ok(stats_json());
-    else
-        resp = http_ok("{\"error\":\"not found\"}");
+    void publish(const std::shared_ptr<const std::string>& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& sub : subs_) {
+            {
+                std::lock_guard<std::mutex> subLock(sub->mutex);
+                if (sub->resync) continue; // the resync will include it
+                if (sub->queue.size() == kQueueLimit) {
+                    sub->queue.clear();
+                    sub->resync = true;
+                } else {
+                    sub->queue.push_back(message);
+                }
+            }
+            sub->ready.notify_one();
+        }
+    }
 
-    send(c, resp.c_str(), (int)resp.size(), 0);
-    closesocket(c);
-}
+private:
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Subscriber>> subs_;
+    std::atomic<size_t> count_{0};
+};
 
-int main() {
-    WSADATA w;
-    if (WSAStartup(MAKEWORD(2,2), &w) != 0) {
-        std::cerr << "WSAStartup failed\n";
-        return 1;
+StreamHub gStreamHub; // /state/stream (SSE text)
+StreamHub gSocketHub; // /state/ws (binary WebSocket frames)
+
+// Latency histogram buckets for /metrics: upper bounds in nanoseconds,
+// 1 us to 2.5 s, plus an implicit +Inf bucket.
+const long long kLatencyBoundsNs[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000LL,
+};
+const int kLatencyBuckets = sizeof(kLatencyBoundsNs) / sizeof(kLatencyBoundsNs[0]) + 1;
+
+// Server counters for /metrics. Recording is a relaxed fetch_add on the
+// calling thread's own shard, so hot paths never share a cache line or
+// take a lock; a scrape sums the shards. Threads are dealt shards round
+// robin and only double up past kShards threads.
+class Metrics {
+public:
+    enum Route { kRouteState, kRouteStateDelta, kRouteStats, kRouteMetrics, kRouteCheckpoint,
+                 kRouteOther, kRoutes };
+    static const char* route_name(int r) {
+        static const char* const names[] = { "/state", "/state?since", "/stats/daily",
+                                             "/metrics", "/admin/checkpoint", "other" };
+        return names[r];
+    }
+    // The status a route counts in its second slot, or null if it only
+    // answers 200.
+    static const char* other_code(int r) {
+        return r == kRouteState ? "304" : r == kRouteCheckpoint ? "500" : nullptr;
     }
 
-    {
-        std::lock_guard<std::mutex> lock(gMutex);
-        gFloors = 5;
+    struct Histogram {
+        unsigned long long buckets[kLatencyBuckets] = {}; // not cumulative
+        unsigned long long sumNs = 0;
+        unsigned long long count() const {
+            unsigned long long n = 0;
+            for (unsigned long long b : buckets) n += b;
+            return n;
+        }
+    };
 
-        upQ.assign(gFloors + 1, {});
-        downQ.assign(gFloors + 1, {});
+    // Sums of every shard, as of one scrape.
+    struct Totals {
+        unsigned long long requests[kRoutes][2] = {}; // [route][0: 200, 1: other_code]
+        Histogram latency[kRoutes];
+        Histogram tick, lockWait, lockHold, queueWait;
+        unsigned long long accepted = 0, badRequests = 0, streamsRefused = 0;
+        long long open = 0;
+    };
 
-        for (int i = 0; i < 3; ++i) {
-            Elevator e;
-            e.id = i + 1;
-            e.currentFloor = i + 1;
-            e.targetFloor = e.currentFloor;
-            e.direction = 0;
-            e.doorOpen = true;
-            e.state = ElevatorState::DoorOpen;
-            e.stateEndTime = Clock::now() + std::chrono::seconds(5);
-            gElevators.push_back(e);
+    void request(Route r, bool other, WallClock::duration d) {
+        Shard& s = shard();
+        bump(s.requests[r][other ? 1 : 0]);
+        observe(s.latency[r], d);
+    }
+    void tick(WallClock::duration d) { observe(shard().tick, d); }
+    void lock_wait(WallClock::duration d) { observe(shard().lockWait, d); }
+    void lock_hold(WallClock::duration d) { observe(shard().lockHold, d); }
+    void queue_wait(WallClock::duration d) { observe(shard().queueWait, d); }
+    void connection_opened() {
+        Shard& s = shard();
+        bump(s.accepted);
+        s.open.fetch_add(1, std::memory_order_relaxed);
+    }
+    // May run on another thread than the open; only the sum is meaningful.
+    void connection_closed() { shard().open.fetch_sub(1, std::memory_order_relaxed); }
+    void bad_request() { bump(shard().badRequests); }
+    void stream_refused() { bump(shard().streamsRefused); }
+
+    Totals totals() const {
+        Totals t;
+        for (const Shard& s : shards_) {
+            for (int r = 0; r < kRoutes; ++r) {
+                t.requests[r][0] += load(s.requests[r][0]);
+                t.requests[r][1] += load(s.requests[r][1]);
+                add(t.latency[r], s.latency[r]);
+            }
+            add(t.tick, s.tick);
+            add(t.lockWait, s.lockWait);
+            add(t.lockHold, s.lockHold);
+            add(t.queueWait, s.queueWait);
+            t.accepted += load(s.accepted);
+            t.badRequests += load(s.badRequests);
+            t.streamsRefused += load(s.streamsRefused);
+            t.open += s.open.load(std::memory_order_relaxed);
         }
+        return t;
     }
 
-    std::thread(sim_loop).detach();
+private:
+    static const int kShards = 32;
+    using Counter = std::atomic<unsigned long long>;
 
-    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(8080);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    struct ShardHistogram {
+        Counter buckets[kLatencyBuckets] = {};
+        Counter sumNs{0};
+    };
 
-    bind(s, (sockaddr*)&addr, sizeof(addr));
-    listen(s, 10);
+    struct alignas(64) Shard {
+        Counter requests[kRoutes][2] = {};
+        ShardHistogram latency[kRoutes];
+        ShardHistogram tick, lockWait, lockHold, queueWait;
+        Counter accepted{0}, badRequests{0}, streamsRefused{0};
+        std::atomic<long long> open{0};
+    };
 
-    std::cout << "Sim server at http://localhost:8080\n";
+    Shard& shard() {
+        thread_local Shard* mine = &shards_[next_.fetch_add(1, std::memory_order_relaxed) % kShards];
+        return *mine;
+    }
+    static void bump(Counter& c) { c.fetch_add(1, std::memory_order_relaxed); }
+    static unsigned long long load(const Counter& c) { return c.load(std::memory_order_relaxed); }
 
-    while (true) {
-        SOCKET c = accept(s, NULL, NULL);
-        if (c != INVALID_SOCKET)
-            std::thread(handle_client, c).detach();
+    static void observe(ShardHistogram& h, WallClock::duration d) {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        int b = 0;
+        while (b < kLatencyBuckets - 1 && ns > kLatencyBoundsNs[b]) ++b;
+        bump(h.buckets[b]);
+        h.sumNs.fetch_add((unsigned long long)std::max(0LL, ns), std::memory_order_relaxed);
+    }
+    static void add(Histogram& into, const ShardHistogram& h) {
+        for (int b = 0; b < kLatencyBuckets; ++b) into.buckets[b] += load(h.buckets[b]);
+        into.sumNs += load(h.sumNs);
     }
 
-    closesocket(s);
-    WSACleanup();
-    return 0;
+    Shard shards_[kShards];
+    std::atomic<unsigned> next_{0};
+};
+
+Metrics gMetrics;
+
+// gMutex guard that reports how long it waited for the lock and held it.
+class TimedLock {
+public:
+    explicit TimedLock(std::mutex& m) : mutex_(m) {
+        auto asked = WallClock::now();
+        mutex_.lock();
+        acquired_ = WallClock::now();
+        gMetrics.lock_wait(acquired_ - asked);
+    }
+    ~TimedLock() {
+        auto held = WallClock::now() - acquired_;
+        mutex_.unlock();
+        gMetrics.lock_hold(held);
+    }
+    TimedLock(const TimedLock&) = delete;
+    TimedLock& operator=(const TimedLock&) = delete;
+
+    WallClock::time_point acquired() const { return acquired_; }
+
+private:
+    std::mutex& mutex_;
+    WallClock::time_point acquired_;
+};
+
+// timing: 1 floor 7.5s, middle floors 7s, last leg 7.5s
+double travel_time_sec(int floors) {
+    if (floors <= 1) return 7.5;
+    return 7.5 + 7.5 + 7.0 * (floors - 2);
+}
+
+// sim hour (30 simulated seconds = 1 hour of the daily profile)
+const int kSimSecondsPerHour = 30;
+
+int sim_hour(TimePoint t) {
+    long long sec = std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+    return (int)((sec / kSimSecondsPerHour) % 24);
+}
+
+double spawn_rate_per_min(int h) {
+    if (h >= 7 && h < 10) return 0.25;
+    if (h >= 11 && h < 14) return 0.15;
+    if (h >= 16 && h < 19) return 0.30;
+    return 0.05;
+}
+
+// The old 100 ms poll used rate/60 as a per-tick spawn probability, so the
+// effective per-floor rate was ten ticks' worth per second. Arrivals keep
+// that rate so traffic volume stays comparable with earlier runs.
+double arrival_rate_per_sec(double ratePerMin) {
+    return ratePerMin / 60.0 * 10.0;
+}
+
+// peak of spawn_rate_per_min, the dominating rate for thinning
+const double kMaxSpawnRatePerMin = 0.30;
+
+bool should_spawn(Simulation& sim, double probability) {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    return dist(sim.rng) < probability;
+}
+
+Passenger make_passenger(Simulation& sim, int floor, TimePoint now) {
+    std::uniform_int_distribution<int> dist(1, sim.floors);
+    int dest = floor;
+    while (dest == floor) dest = dist(sim.rng);
+
+    Passenger p;
+    p.startFloor = floor;
+    p.destFloor = dest;
+    p.direction = (dest > floor ? +1 : -1);
+    p.created = now;
+    return p;
+}
+
+// Each floor is a Poisson arrival process following the hourly profile.
+// Candidates are drawn at the peak rate and kept with probability
+// rate(now) / peak (non-homogeneous thinning), so the work per floor is
+// proportional to arrivals, not to elapsed time.
+TimePoint next_arrival_candidate(Simulation& sim, TimePoint after) {
+    using namespace std::chrono;
+    std::exponential_distribution<double> gapSec(arrival_rate_per_sec(kMaxSpawnRatePerMin));
+    return after + duration_cast<SimClock::duration>(duration<double>(gapSec(sim.rng)));
+}
+
+unsigned floor_arrival(Simulation& sim, int floor, TimePoint now) {
+    double rateMin = spawn_rate_per_min(sim_hour(now));
+    if (!should_spawn(sim, rateMin / kMaxSpawnRatePerMin)) return kChangedNothing;
+
+    Passenger p = make_passenger(sim, floor, now);
+    if (p.direction == +1) {
+        sim.upQ[floor].push_back(p);
+        HallCalls::set(sim.calls.up, floor, true);
+    } else {
+        sim.downQ[floor].push_back(p);
+        HallCalls::set(sim.calls.down, floor, true);
+    }
+    sim.stats.totalPassengers++;
+    if (sim.journal)
+        sim.journal->append(now, JournalKind::Spawn, kJournalNoCar, floor, p.destFloor, 0.0);
+    return kChangedStats;
+}
+
+// The original policy: first onboard passenger's destination, otherwise
+// the nearest floor with any hall call.
+class NearestCallDispatcher : public Dispatcher {
+public:
+    int next_target(const Simulation& sim, int c, TimePoint) override {
+        const Fleet& f = sim.fleet;
+        if (!f.onboard[c].empty())
+            return f.onboard[c].front().destFloor;
+
+        int cur = f.currentFloor[c];
+        int best = sim.calls.nearest(cur);
+        return best < 0 ? cur : best;
+    }
+};
+
+// Collective LOOK: keep sweeping in one direction, stopping at the nearest
+// onboard destination or same-direction hall call ahead. Calls the other
+// way are picked up at the reversal point: the farthest of them ahead once
+// nothing else is. Reverse only when nothing at all is left ahead.
+class LookDispatcher : public Dispatcher {
+public:
+    int next_target(const Simulation& sim, int c, TimePoint) override {
+        if ((int)sweep_.size() <= c) sweep_.resize(c + 1, +1);
+        int cur = sim.fleet.currentFloor[c];
+
+        for (int pass = 0; pass < 2; ++pass) {
+            int dir = sweep_[c];
+            int stop = next_stop(sim, c, cur, dir);
+            if (stop > 0) return stop;
+            sweep_[c] = -dir;
+        }
+        return cur;
+    }
+
+    std::vector<int> saved_state() const override { return sweep_; }
+    void restore_state(std::vector<int> sweep) override { sweep_ = std::move(sweep); }
+
+private:
+    // Next floor to stop at sweeping `dir` from `cur`, or -1 if nothing is
+    // ahead.
+    static int next_stop(const Simulation& sim, int c, int cur, int dir) {
+        const HallCalls& calls = sim.calls;
+        int best = -1;
+        if (dir > 0 && cur < sim.floors) best = HallCalls::first_at_or_above(calls.up, cur + 1);
+        if (dir < 0 && cur > 1) best = HallCalls::last_at_or_below(calls.down, cur - 1);
+        for (const Passenger& p : sim.fleet.onboard[c]) {
+            int d = (p.destFloor - cur) * dir;
+            if (d > 0 && (best < 0 || d < (best - cur) * dir)) best = p.destFloor;
+        }
+        if (best > 0) return best;
+
+        int turn = dir > 0 ? HallCalls::last_at_or_below(calls.down, sim.floors)
+                           : HallCalls::first_at_or_above(calls.up, 1);
+        return turn > 0 && (turn - cur) * dir > 0 ? turn : -1;
+    }
+
+    std::vector<int> sweep_; // +1 up, -1 down, per car
+};
+
+// Group controller: each waiting floor belongs to the car with the lowest
+// estimated time of arrival. An idle car takes the closest floor it owns,
+// so cars no longer all race to the same call. Onboard passengers are
+// delivered first, nearest destination first.
+class EtaDispatcher : public Dispatcher {
+public:
+    int next_target(const Simulation& sim, int c, TimePoint now) override {
+        const Fleet& f = sim.fleet;
+        int cur = f.currentFloor[c];
+
+        if (!f.onboard[c].empty()) {
+            int best = f.onboard[c].front().destFloor;
+            for (const Passenger& p : f.onboard[c])
+                if (std::abs(p.destFloor - cur) < std::abs(best - cur)) best = p.destFloor;
+            return best;
+        }
+
+        int best = cur;
+        double bestEta = 0.0;
+        sim.calls.for_each([&](int fl) {
+            double mine = eta_sec(sim, c, fl, now);
+            if (std::isinf(mine)) return;
+            for (int k = 0; k < f.size(); ++k)
+                if (k != c && eta_sec(sim, k, fl, now) < mine) return;
+            if (best == cur || mine < bestEta) { best = fl; bestEta = mine; }
+        });
+        return best;
+    }
+
+private:
+    // Seconds until car k could open its doors at `fl`, plus a penalty per
+    // passenger already aboard (they are served first). Passengers only
+    // board on arrival, so a car parked or closing its doors at `fl` has to
+    // leave and come back: it is never the owner of that floor.
+    static double eta_sec(const Simulation& sim, int k, int fl, TimePoint now) {
+        const Fleet& f = sim.fleet;
+        if (f.state[k] != ElevatorState::Moving && fl == f.currentFloor[k])
+            return std::numeric_limits<double>::infinity();
+
+        double remaining = std::max(0.0,
+            std::chrono::duration<double>(f.stateEndTime[k] - now).count());
+        double load = 10.0 * f.onboard[k].size();
+
+        switch (f.state[k]) {
+            case ElevatorState::Idle:
+                return travel_time_sec(std::abs(fl - f.currentFloor[k])) + load;
+            case ElevatorState::Moving:
+                if (fl == f.targetFloor[k]) return remaining;
+                return remaining + 5.0 + 1.0 + travel_time_sec(std::abs(fl - f.targetFloor[k])) + load;
+            case ElevatorState::DoorOpen:
+                return remaining + 1.0 + travel_time_sec(std::abs(fl - f.currentFloor[k])) + load;
+        }
+        return 0.0;
+    }
+};
+
+struct DispatcherEntry {
+    const char* name;
+    std::unique_ptr<Dispatcher> (*make)();
+};
+
+const std::vector<DispatcherEntry>& dispatcher_registry() {
+    static const std::vector<DispatcherEntry> registry = {
+        { "nearest", [] { return std::unique_ptr<Dispatcher>(new NearestCallDispatcher); } },
+        { "look",    [] { return std::unique_ptr<Dispatcher>(new LookDispatcher); } },
+        { "eta",     [] { return std::unique_ptr<Dispatcher>(new EtaDispatcher); } },
+    };
+    return registry;
+}
+
+// nullptr for an unknown name
+std::unique_ptr<Dispatcher> make_dispatcher(const std::string& name) {
+    for (const auto& entry : dispatcher_registry())
+        if (name == entry.name) return entry.make();
+    return nullptr;
+}
+
+// Advances car `c` if its current state has run out. Re-arming an idle car
+// that has nowhere to go changes nothing a reader can see.
+unsigned update_elevator(Simulation& sim, int c, TimePoint now) {
+    using namespace std::chrono;
+    Fleet& f = sim.fleet;
+    ElevatorStats& es = f.stats[c];
+    std::vector<Passenger>& onboard = f.onboard[c];
+
+    if (f.state[c] == ElevatorState::Idle) {
+        if (now >= f.stateEndTime[c]) {
+            int next = sim.dispatcher->next_target(sim, c, now);
+            if (next == f.currentFloor[c]) {
+                f.direction[c] = 0;
+                f.stateEndTime[c] = now + seconds(1);
+                return kChangedNothing;
+            }
+
+            f.targetFloor[c] = next;
+            int diff = f.targetFloor[c] - f.currentFloor[c];
+            int floors = std::abs(diff);
+
+            f.direction[c] = diff > 0 ? +1 : -1;
+            f.state[c] = ElevatorState::Moving;
+
+            double tSec = travel_time_sec(floors);
+            f.stateEndTime[c] = now + duration_cast<SimClock::duration>(duration<double>(tSec));
+
+            // trip stats
+            sim.stats.totalTrips++;
+            sim.stats.completedTrips++;
+            sim.stats.totalTripSec += tSec;
+            sim.stats.tripSec.add(tSec);
+            es.trips++;
+            es.tripSec.add(tSec);
+            if (sim.journal)
+                sim.journal->append(now, JournalKind::Depart, c, f.currentFloor[c], next, tSec);
+
+            int h = sim_hour(now);
+            sim.hourly[h].trips++;
+            return kChangedState | kChangedStats;
+        }
+    }
+    else if (f.state[c] == ElevatorState::Moving) {
+        if (now >= f.stateEndTime[c]) {
+            int diff = std::abs(f.targetFloor[c] - f.currentFloor[c]);
+
+            double loadFactor = 1.0 + 0.05 * onboard.size();
+            double energy = 0.05 * diff * loadFactor;
+
+            sim.stats.totalEnergyKWh += energy;
+            es.energyKWh += energy;
+            sim.hourly[sim_hour(now)].energyKWh += energy;
+
+            int floor = f.targetFloor[c];
+            if (sim.journal)
+                sim.journal->append(now, JournalKind::Arrive, c, floor, (int)onboard.size(), energy);
+            f.currentFloor[c] = floor;
+            f.direction[c] = 0;
+            f.state[c] = ElevatorState::DoorOpen;
+            f.stateEndTime[c] = now + seconds(5); // doors open/close timing
+
+            es.stopCount++;
+            es.doorOpenCount++;
+
+            // exit
+            auto it = onboard.begin();
+            while (it != onboard.end()) {
+                if (it->destFloor == floor) {
+                    sim.stats.completedPassengers++;
+                    es.passengersMoved++;
+                    if (sim.journal)
+                        sim.journal->append(now, JournalKind::Alight, c, floor, it->startFloor,
+                                            duration<double>(now - it->created).count());
+                    it = onboard.erase(it);
+                } else ++it;
+            }
+
+            // enter
+            int capLeft = f.capacity[c] - (int)onboard.size();
+            auto& U = sim.upQ[floor];
+            auto& D = sim.downQ[floor];
+
+            auto board = [&](std::deque<Passenger>& q) {
+                while (capLeft > 0 && !q.empty()) {
+                    Passenger p = q.front(); q.pop_front();
+                    double waitSec = duration<double>(now - p.created).count();
+
+                    sim.stats.totalWaitSec += waitSec;
+                    sim.stats.waitSec.add(waitSec);
+                    es.waitSec.add(waitSec);
+                    int h2 = sim_hour(now);
+                    sim.hourly[h2].totalWaitSec += waitSec;
+                    sim.hourly[h2].waitCount++;
+                    sim.hourly[h2].waitSec.add(waitSec);
+                    if (sim.journal)
+                        sim.journal->append(now, JournalKind::Board, c, floor, p.destFloor, waitSec);
+
+                    onboard.push_back(p);
+                    capLeft--;
+                }
+            };
+
+            board(U);
+            board(D);
+            if (U.empty()) HallCalls::set(sim.calls.up, floor, false);
+            if (D.empty()) HallCalls::set(sim.calls.down, floor, false);
+            return kChangedState | kChangedStats;
+        }
+    }
+    else if (f.state[c] == ElevatorState::DoorOpen) {
+        if (now >= f.stateEndTime[c]) {
+            f.state[c] = ElevatorState::Idle;
+            f.stateEndTime[c] = now + seconds(1);
+            return kChangedState;
+        }
+    }
+    return kChangedNothing;
+}
+
+void schedule(Simulation& sim, TimePoint at, EventKind kind, int index) {
+    sim.events.push(SimEvent{ at, kind, index, sim.eventSeq++ });
+}
+
+// Runs every event due at or before `now`, each at its own timestamp, and
+// re-arms the next one. For gSim the caller holds gMutex.
+void run_due_events(Simulation& sim, TimePoint now) {
+    while (!sim.events.empty() && sim.events.top().at <= now) {
+        SimEvent ev = sim.events.top();
+        sim.events.pop();
+        sim.eventCount++;
+        sim.now = ev.at;
+
+        unsigned changed;
+        if (ev.kind == EventKind::Arrival) {
+            changed = floor_arrival(sim, ev.index, ev.at);
+            schedule(sim, next_arrival_candidate(sim, ev.at), EventKind::Arrival, ev.index);
+        } else {
+            changed = update_elevator(sim, ev.index, ev.at);
+            schedule(sim, sim.fleet.stateEndTime[ev.index], EventKind::Elevator, ev.index);
+        }
+        if (changed & kChangedState) {
+            sim.stateVersion++;
+            sim.stateChangedAt = ev.at;
+            sim.fleet.version[ev.index] = sim.stateVersion;
+        }
+        if (changed & kChangedStats) sim.statsVersion++;
+    }
+}
+
+// Runs `sim` unpaced to the end of simulated day `days`.
+void run_days(Simulation& sim, int days) {
+    TimePoint end = TimePoint{} + std::chrono::seconds(1LL * days * 24 * kSimSecondsPerHour);
+    run_due_events(sim, end - SimClock::duration(1));
+}
+
+// Checkpoints (/admin/checkpoint, --checkpoint, --restore): everything a
+// Simulation needs to carry on exactly where it was, in native byte order.
+// Hall-call bits are rebuilt from the queues, and the dispatcher from its
+// name plus saved_state().
+const char kCheckpointMagic[8] = { 'S', 'I', 'M', 'C', 'K', 'P', 'T', 0 };
+const std::uint32_t kCheckpointVersion = 2;
+
+class CheckpointWriter {
+public:
+    template <class T>
+    CheckpointWriter& pod(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "raw bytes only");
+        buf_.append((const char*)&v, sizeof(v));
+        return *this;
+    }
+    CheckpointWriter& time(TimePoint t) { return pod((std::int64_t)t.time_since_epoch().count()); }
+    CheckpointWriter& str(const std::string& v) {
+        pod((std::uint32_t)v.size());
+        buf_.append(v);
+        return *this;
+    }
+
+    std::string& bytes() { return buf_; }
+
+private:
+    std::string buf_;
+};
+
+// Reads what CheckpointWriter wrote. A short or malformed input makes
+// ok() false for good; later reads then do nothing.
+class CheckpointReader {
+public:
+    CheckpointReader(const char* data, size_t size) : p_(data), end_(data + size) {}
+
+    template <class T>
+    CheckpointReader& pod(T& v) {
+        if (!ok_ || (size_t)(end_ - p_) < sizeof(v)) { ok_ = false; return *this; }
+        std::memcpy(&v, p_, sizeof(v));
+        p_ += sizeof(v);
+        return *this;
+    }
+    CheckpointReader& time(TimePoint& t) {
+        std::int64_t ns = 0;
+        pod(ns);
+        t = TimePoint{ SimClock::duration(ns) };
+        return *this;
+    }
+    CheckpointReader& str(std::string& v) {
+        std::uint32_t n = 0;
+        if (!pod(n).ok() || (size_t)(end_ - p_) < n) { ok_ = false; return *this; }
+        v.assign(p_, n);
+        p_ += n;
+        return *this;
+    }
+    // A count of items at least `minBytes` each that the rest can hold.
+    CheckpointReader& count(std::uint32_t& n, size_t minBytes) {
+        if (pod(n).ok() && (size_t)(end_ - p_) / minBytes < n) ok_ = false;
+        return *this;
+    }
+
+    bool ok() const { return ok_; }
+    bool fail() { ok_ = false; return false; }
+    bool done() const { return ok_ && p_ == end_; }
+
+private:
+    const char* p_;
+    const char* end_;
+    bool ok_ = true;
+};
+
+// The engine's state words as u32s. The standard only exposes them through
+// the stream operators, so they travel through text here; libstdc++ adds
+// the position within them as one more word.
+void save_part(CheckpointWriter& w, const std::mt19937& rng) {
+    std::ostringstream text;
+    text << rng;
+    std::istringstream in(text.str());
+    std::vector<std::uint32_t> words;
+    for (std::uint32_t v; in >> v;) words.push_back(v);
+    w.pod((std::uint32_t)words.size());
+    for (std::uint32_t v : words) w.pod(v);
+}
+
+bool load_part(CheckpointReader& r, std::mt19937& rng) {
+    std::uint32_t n = 0;
+    if (!r.count(n, sizeof(std::uint32_t)).ok() || n < std::mt19937::state_size ||
+        n > std::mt19937::state_size + 1)
+        return r.fail();
+    std::string text;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        std::uint32_t v = 0;
+        r.pod(v);
+        text += std::to_string(v);
+        text += ' ';
+    }
+    std::istringstream in(text);
+    if (!r.ok() || !(in >> rng)) return r.fail();
+    return true;
+}
+
+void save_part(CheckpointWriter& w, const Passenger& p) {
+    w.pod((std::int32_t)p.startFloor).pod((std::int32_t)p.destFloor).time(p.created);
+}
+
+bool load_part(CheckpointReader& r, Passenger& p, int floors) {
+    std::int32_t start = 0, dest = 0;
+    r.pod(start).pod(dest).time(p.created);
+    if (!r.ok() || start < 1 || start > floors || dest < 1 || dest > floors || start == dest)
+        return r.fail();
+    p.startFloor = start;
+    p.destFloor = dest;
+    p.direction = dest > start ? +1 : -1;
+    return true;
+}
+
+template <class Queue>
+void save_part(CheckpointWriter& w, const Queue& passengers) {
+    w.pod((std::uint32_t)passengers.size());
+    for (const Passenger& p : passengers) save_part(w, p);
+}
+
+template <class Queue>
+bool load_part(CheckpointReader& r, Queue& passengers, int floors) {
+    std::uint32_t n = 0;
+    if (!r.count(n, 16).ok()) return false;
+    passengers.resize(n);
+    for (Passenger& p : passengers)
+        if (!load_part(r, p, floors)) return false;
+    return true;
+}
+
+void save_part(CheckpointWriter& w, const ElevatorStats& es) {
+    w.pod(es.trips).pod(es.passengersMoved).pod(es.energyKWh).pod(es.doorOpenCount)
+     .pod(es.stopCount);
+    es.waitSec.save(w);
+    es.tripSec.save(w);
+}
+
+bool load_part(CheckpointReader& r, ElevatorStats& es) {
+    r.pod(es.trips).pod(es.passengersMoved).pod(es.energyKWh).pod(es.doorOpenCount)
+     .pod(es.stopCount);
+    return r.ok() && es.waitSec.load(r) && es.tripSec.load(r);
+}
+
+void save_part(CheckpointWriter& w, const GlobalStats& gs) {
+    w.pod(gs.totalTrips).pod(gs.totalPassengers).pod(gs.completedPassengers)
+     .pod(gs.totalEnergyKWh).pod(gs.totalWaitSec).pod(gs.totalTripSec).pod(gs.completedTrips);
+    gs.waitSec.save(w);
+    gs.tripSec.save(w);
+}
+
+bool load_part(CheckpointReader& r, GlobalStats& gs) {
+    r.pod(gs.totalTrips).pod(gs.totalPassengers).pod(gs.completedPassengers)
+     .pod(gs.totalEnergyKWh).pod(gs.totalWaitSec).pod(gs.totalTripSec).pod(gs.completedTrips);
+    return r.ok() && gs.waitSec.load(r) && gs.tripSec.load(r);
+}
+
+void save_part(CheckpointWriter& w, const HourlyBucket& hb) {
+    w.pod(hb.trips).pod(hb.energyKWh).pod(hb.totalWaitSec).pod(hb.waitCount);
+    hb.waitSec.save(w);
+}
+
+bool load_part(CheckpointReader& r, HourlyBucket& hb) {
+    r.pod(hb.trips).pod(hb.energyKWh).pod(hb.totalWaitSec).pod(hb.waitCount);
+    return r.ok() && hb.waitSec.load(r);
+}
+
+// `sim` as of simulated time `at` (no earlier than sim.now; a paced server
+// may have slept past its last event).
+std::string save_checkpoint(const Simulation& sim, TimePoint at) {
+    CheckpointWriter w;
+    w.pod(kCheckpointMagic).pod(kCheckpointVersion)
+     .pod(sim.seed).str(sim.dispatcherName)
+     .pod((std::int32_t)sim.floors).pod((std::int32_t)sim.fleet.size())
+     .time(at).time(sim.now).time(sim.stateChangedAt)
+     .pod(sim.eventSeq).pod(sim.eventCount).pod(sim.stateVersion).pod(sim.statsVersion);
+
+    save_part(w, sim.rng);
+
+    const Fleet& f = sim.fleet;
+    for (int c = 0; c < f.size(); ++c) {
+        w.pod((std::int32_t)f.id[c]).pod((std::int32_t)f.capacity[c])
+         .pod((std::int32_t)f.currentFloor[c]).pod((std::int32_t)f.targetFloor[c])
+         .pod((std::int8_t)f.direction[c]).pod((std::uint8_t)f.state[c])
+         .time(f.stateEndTime[c]).pod(f.version[c]);
+        save_part(w, f.onboard[c]);
+        save_part(w, f.stats[c]);
+    }
+    for (int fl = 1; fl <= sim.floors; ++fl) {
+        save_part(w, sim.upQ[fl]);
+        save_part(w, sim.downQ[fl]);
+    }
+    save_part(w, sim.stats);
+    for (const HourlyBucket& hb : sim.hourly) save_part(w, hb);
+
+    // in the order they will run; restoring pushes them back with the same seq
+    auto events = sim.events;
+    w.pod((std::uint32_t)events.size());
+    for (; !events.empty(); events.pop()) {
+        const SimEvent& ev = events.top();
+        w.time(ev.at).pod((std::uint8_t)ev.kind).pod((std::int32_t)ev.index).pod(ev.seq);
+    }
+
+    std::vector<int> dispatch = sim.dispatcher->saved_state();
+    w.pod((std::uint32_t)dispatch.size());
+    for (int v : dispatch) w.pod((std::int32_t)v);
+    return std::move(w.bytes());
+}
+
+// Rebuilds `sim` from save_checkpoint() output; `at` is the time it was
+// taken. False, with `sim` unusable and `error` set, if `bytes` is not a
+// checkpoint this build can read.
+bool load_checkpoint(const std::string& bytes, Simulation& sim, TimePoint& at,
+                     std::string& error) {
+    CheckpointReader r(bytes.data(), bytes.size());
+    char magic[8] = {};
+    std::uint32_t version = 0;
+    r.pod(magic).pod(version);
+    if (!r.ok() || std::memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0 ||
+        version != kCheckpointVersion) {
+        error = "not a version " + std::to_string(kCheckpointVersion) + " checkpoint";
+        return false;
+    }
+
+    sim = Simulation{};
+    std::int32_t floors = 0, cars = 0;
+    r.pod(sim.seed).str(sim.dispatcherName).pod(floors).pod(cars)
+     .time(at).time(sim.now).time(sim.stateChangedAt)
+     .pod(sim.eventSeq).pod(sim.eventCount).pod(sim.stateVersion).pod(sim.statsVersion);
+    if (!r.ok() || floors < 2 || cars < 1 || cars > 0xffff) {
+        error = "bad building";
+        return false;
+    }
+    sim.floors = floors;
+    sim.dispatcher = make_dispatcher(sim.dispatcherName);
+    if (!sim.dispatcher) {
+        error = "unknown dispatcher '" + sim.dispatcherName + "'";
+        return false;
+    }
+    if (!load_part(r, sim.rng)) {
+        error = "bad RNG state";
+        return false;
+    }
+
+    Fleet& f = sim.fleet;
+    for (int c = 0; c < cars; ++c) {
+        std::int32_t id = 0, capacity = 0, current = 0, target = 0;
+        std::int8_t direction = 0;
+        std::uint8_t state = 0;
+        TimePoint endTime;
+        r.pod(id).pod(capacity).pod(current).pod(target).pod(direction).pod(state).time(endTime);
+        if (!r.ok() || capacity < 1 || current < 1 || current > floors || target < 1 ||
+            target > floors || state > (std::uint8_t)ElevatorState::DoorOpen) {
+            error = "bad car " + std::to_string(c);
+            return false;
+        }
+        f.add(id, current, capacity, (ElevatorState)state, endTime);
+        f.targetFloor[c] = target;
+        f.direction[c] = direction;
+        r.pod(f.version[c]);
+        if (!load_part(r, f.onboard[c], floors) || !load_part(r, f.stats[c])) {
+            error = "bad car " + std::to_string(c);
+            return false;
+        }
+    }
+
+    sim.upQ.assign(floors + 1, {});
+    sim.downQ.assign(floors + 1, {});
+    sim.calls.reset(floors);
+    for (int fl = 1; fl <= floors; ++fl) {
+        if (!load_part(r, sim.upQ[fl], floors) || !load_part(r, sim.downQ[fl], floors)) {
+            error = "bad queue at floor " + std::to_string(fl);
+            return false;
+        }
+        HallCalls::set(sim.calls.up, fl, !sim.upQ[fl].empty());
+        HallCalls::set(sim.calls.down, fl, !sim.downQ[fl].empty());
+    }
+
+    bool statsOk = load_part(r, sim.stats);
+    for (HourlyBucket& hb : sim.hourly) statsOk = statsOk && load_part(r, hb);
+    if (!statsOk) {
+        error = "bad stats";
+        return false;
+    }
+
+    std::uint32_t events = 0;
+    r.count(events, 21);
+    for (std::uint32_t i = 0; i < events && r.ok(); ++i) {
+        SimEvent ev;
+        std::uint8_t kind = 0;
+        std::int32_t index = 0;
+        r.time(ev.at).pod(kind).pod(index).pod(ev.seq);
+        ev.kind = (EventKind)kind;
+        ev.index = index;
+        bool valid = kind == (std::uint8_t)EventKind::Arrival ? index >= 1 && index <= floors
+                   : kind == (std::uint8_t)EventKind::Elevator && index >= 0 && index < cars;
+        if (!valid) r.fail();
+        else sim.events.push(ev);
+    }
+    if (!r.ok() || sim.events.empty()) {
+        error = "bad event queue";
+        return false;
+    }
+
+    std::uint32_t n = 0;
+    std::vector<int> dispatch;
+    r.count(n, 4);
+    for (std::uint32_t i = 0; i < n && r.ok(); ++i) {
+        std::int32_t v = 0;
+        r.pod(v);
+        dispatch.push_back(v);
+    }
+    if (!r.done()) {
+        error = "bad dispatcher state or trailing bytes";
+        return false;
+    }
+    sim.dispatcher->restore_state(std::move(dispatch));
+    return true;
+}
+
+bool read_file(const std::string& path, std::string& bytes, std::string& error) {
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        error = path + ": " + std::strerror(errno);
+        return false;
+    }
+    bytes.clear();
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0) bytes.append(chunk, n);
+    bool ok = !std::ferror(f);
+    std::fclose(f);
+    if (!ok) error = path + ": read error";
+    return ok;
+}
+
+// Writes PATH.tmp and renames it over PATH, so PATH is always a whole file.
+bool write_file(const std::string& path, const std::string& bytes, std::string& error) {
+    std::string tmp = path + ".tmp";
+    std::FILE* f = std::fopen(tmp.c_str(), "wb");
+    bool ok = f && std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    if (f && std::fclose(f) != 0) ok = false;
+#ifdef _WIN32
+    if (ok) std::remove(path.c_str()); // rename does not replace on Windows
+#endif
+    if (ok && std::rename(tmp.c_str(), path.c_str()) != 0) ok = false;
+    if (!ok) {
+        error = path + ": " + std::strerror(errno);
+        std::remove(tmp.c_str());
+    }
+    return ok;
+}
+
+std::shared_ptr<const FleetSnapshot> take_fleet_snapshot(const Simulation& sim) {
+    auto snap = std::make_shared<FleetSnapshot>();
+    snap->version = sim.stateVersion;
+    snap->at = sim.stateChangedAt;
+    snap->floors = sim.floors;
+
+    const Fleet& f = sim.fleet;
+    snap->cars.reserve(f.size());
+    for (int c = 0; c < f.size(); ++c)
+        snap->cars.push_back(CarSnapshot{ f.id[c], f.currentFloor[c], f.targetFloor[c],
+                                          f.direction[c], f.state[c], (int)f.onboard[c].size(),
+                                          f.capacity[c], f.stateEndTime[c] });
+    return snap;
+}
+
+std::shared_ptr<const StatsSnapshot> take_stats_snapshot(const Simulation& sim) {
+    auto snap = std::make_shared<StatsSnapshot>();
+    snap->version = sim.statsVersion;
+    snap->floors = sim.floors;
+    snap->stats = sim.stats;
+    std::copy(std::begin(sim.hourly), std::end(sim.hourly), snap->hourly);
+    snap->ids = sim.fleet.id;
+    snap->cars = sim.fleet.stats;
+    for (int f = 1; f <= sim.floors; ++f) {
+        snap->waitingUp += (long long)sim.upQ[f].size();
+        snap->waitingDown += (long long)sim.downQ[f].size();
+    }
+    return snap;
+}
+
+// Append-only text buffer for response bodies and heads. Numbers go
+// through std::to_chars: no locale, no stream state, no temporaries.
+// Doubles use the %g, 6-significant-digit form ostream printed, so the
+// output is unchanged. clear() keeps the capacity, so a writer that is
+// reused does not allocate once it has grown to size.
+class JsonWriter {
+public:
+    void clear() { buf_.clear(); }
+    const std::string& str() const { return buf_; }
+
+    template <size_t N>
+    JsonWriter& raw(const char (&literal)[N]) { buf_.append(literal, N - 1); return *this; }
+    JsonWriter& raw(const std::string& s) { buf_.append(s); return *this; }
+    JsonWriter& raw(const char* s, size_t n) { buf_.append(s, n); return *this; }
+
+    template <class Int>
+    JsonWriter& num(Int v) {
+        char tmp[24];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        buf_.append(tmp, res.ptr - tmp);
+        return *this;
+    }
+
+    JsonWriter& num(double v) {
+        char tmp[32];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v, std::chars_format::general, 6);
+        buf_.append(tmp, res.ptr - tmp);
+        return *this;
+    }
+
+private:
+    std::string buf_;
+};
+
+// Per-thread scratch writer for the string-returning serializers below.
+JsonWriter& scratch_writer() {
+    thread_local JsonWriter w;
+    w.clear();
+    return w;
+}
+
+const char* state_name(ElevatorState st) {
+    switch (st) {
+        case ElevatorState::Idle:     return "Idle";
+        case ElevatorState::Moving:   return "Moving";
+        case ElevatorState::DoorOpen: return "DoorOpen";
+    }
+    return "";
+}
+
+// ✅ UPDATED: /state now includes state + remainingMs
+// remainingMs counts from the snapshot's own time, so the body is a pure
+// function of the version and can be cached.
+void write_car_json(JsonWriter& out, const CarSnapshot& e, TimePoint at) {
+    long long remainingMs =
+        std::chrono::duration_cast<std::chrono::milliseconds>(e.stateEndTime - at).count();
+    if (remainingMs < 0) remainingMs = 0;
+
+    const char* name = state_name(e.state);
+    out.raw("{\"id\":").num(e.id)
+       .raw(",\"currentFloor\":").num(e.currentFloor)
+       .raw(",\"targetFloor\":").num(e.targetFloor)
+       .raw(",\"direction\":").num(e.direction);
+    if (e.state == ElevatorState::DoorOpen) out.raw(",\"doorOpen\":true");
+    else out.raw(",\"doorOpen\":false");
+    out.raw(",\"load\":").num(e.load)
+       .raw(",\"capacity\":").num(e.capacity)
+       .raw(",\"state\":\"").raw(name, std::strlen(name)).raw("\"")
+       .raw(",\"remainingMs\":").num(remainingMs)
+       .raw("}");
+}
+
+long long as_of_ms(const FleetSnapshot& snap) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(snap.at.time_since_epoch()).count();
+}
+
+// remainingMs count from "asOfMs", the simulated time of the snapshot.
+void state_json(JsonWriter& out, const FleetSnapshot& snap) {
+    out.raw("{\"floorCount\":").num(snap.floors)
+       .raw(",\"asOfMs\":").num(as_of_ms(snap))
+       .raw(",\"elevators\":[");
+    for (size_t i = 0; i < snap.cars.size(); ++i) {
+        if (i) out.raw(",");
+        write_car_json(out, snap.cars[i], snap.at);
+    }
+    out.raw("]}");
+}
+
+std::string state_json(const FleetSnapshot& snap) {
+    JsonWriter& w = scratch_writer();
+    state_json(w, snap);
+    return w.str();
+}
+
+// /state?since= body: the cars flagged in `changed`, or all of them with
+// "full":true when `changed` is null. `version` is what the client passes
+// as `since` next time.
+void state_delta_json(JsonWriter& out, const FleetSnapshot& snap, const std::string& version,
+                      const std::vector<char>* changed) {
+    out.raw("{\"version\":\"").raw(version).raw("\",");
+    if (changed) out.raw("\"full\":false,");
+    else out.raw("\"full\":true,");
+    out.raw("\"floorCount\":").num(snap.floors)
+       .raw(",\"asOfMs\":").num(as_of_ms(snap))
+       .raw(",\"elevators\":[");
+
+    bool first = true;
+    for (size_t i = 0; i < snap.cars.size(); ++i) {
+        if (changed && !(*changed)[i]) continue;
+        if (!first) out.raw(",");
+        first = false;
+        write_car_json(out, snap.cars[i], snap.at);
+    }
+    out.raw("]}");
+}
+
+std::string state_delta_json(const FleetSnapshot& snap, const std::string& version,
+                             const std::vector<char>* changed) {
+    JsonWriter& w = scratch_writer();
+    state_delta_json(w, snap, version, changed);
+    return w.str();
+}
+
+double avg_wait_sec(const GlobalStats& st) {
+    return st.completedPassengers > 0 ? st.totalWaitSec / st.completedPassengers : 0.0;
+}
+
+double avg_trip_sec(const GlobalStats& st) {
+    return st.completedTrips > 0 ? st.totalTripSec / st.completedTrips : 0.0;
+}
+
+double avg_energy_kwh(const GlobalStats& st) {
+    return st.totalTrips > 0 ? st.totalEnergyKWh / st.totalTrips : 0.0;
+}
+
+// {"p50":..,"p95":..,"p99":..} in seconds; the percentiles SLAs quote.
+void write_quantiles(JsonWriter& out, const QuantileSketch& q) {
+    out.raw("{\"p50\":").num(q.quantile(0.50))
+       .raw(",\"p95\":").num(q.quantile(0.95))
+       .raw(",\"p99\":").num(q.quantile(0.99))
+       .raw("}");
+}
+
+void stats_json(JsonWriter& out, const StatsSnapshot& snap) {
+    double avgWait = avg_wait_sec(snap.stats);
+    double avgTrip = avg_trip_sec(snap.stats);
+    double avgEnergy = avg_energy_kwh(snap.stats);
+
+    int peakHour = 0, maxTrips = 0;
+    for (int h = 0; h < 24; ++h)
+        if (snap.hourly[h].trips > maxTrips) { maxTrips = snap.hourly[h].trips; peakHour = h; }
+
+    out.raw("{\"floorCount\":").num(snap.floors)
+       .raw(",\"totalTrips\":").num(snap.stats.totalTrips)
+       .raw(",\"totalPassengers\":").num(snap.stats.totalPassengers)
+       .raw(",\"avgWaitSec\":").num(avgWait)
+       .raw(",\"waitSec\":");
+    write_quantiles(out, snap.stats.waitSec);
+    out.raw(",\"avgTripSec\":").num(avgTrip)
+       .raw(",\"tripSec\":");
+    write_quantiles(out, snap.stats.tripSec);
+    out.raw(",\"avgEnergyKWh\":").num(avgEnergy)
+       .raw(",\"peakHour\":").num(peakHour);
+
+    out.raw(",\"elevators\":[");
+    for (size_t i = 0; i < snap.cars.size(); ++i) {
+        const ElevatorStats& e = snap.cars[i];
+        if (i) out.raw(",");
+        out.raw("{\"id\":").num(snap.ids[i])
+           .raw(",\"trips\":").num(e.trips)
+           .raw(",\"passengersMoved\":").num(e.passengersMoved)
+           .raw(",\"energyKWh\":").num(e.energyKWh)
+           .raw(",\"doorOpenCount\":").num(e.doorOpenCount)
+           .raw(",\"stopCount\":").num(e.stopCount)
+           .raw(",\"waitSec\":");
+        write_quantiles(out, e.waitSec);
+        out.raw(",\"tripSec\":");
+        write_quantiles(out, e.tripSec);
+        out.raw("}");
+    }
+    out.raw("],");
+
+    out.raw("\"hourly\":[");
+    for (int h = 0; h < 24; ++h) {
+        if (h) out.raw(",");
+        double hAvgWait =
+            snap.hourly[h].waitCount > 0
+                ? snap.hourly[h].totalWaitSec / snap.hourly[h].waitCount
+                : 0.0;
+        out.raw("{\"hour\":").num(h)
+           .raw(",\"trips\":").num(snap.hourly[h].trips)
+           .raw(",\"avgWaitSec\":").num(hAvgWait)
+           .raw(",\"waitSec\":");
+        write_quantiles(out, snap.hourly[h].waitSec);
+        out.raw(",\"energyKWh\":").num(snap.hourly[h].energyKWh)
+           .raw("}");
+    }
+    out.raw("]}");
+}
+
+std::string stats_json(const StatsSnapshot& snap) {
+    JsonWriter& w = scratch_writer();
+    stats_json(w, snap);
+    return w.str();
+}
+
+// Bytes a connection still has to send. Response heads and uncached
+// bodies are copied into one reusable buffer; cached bodies are only
+// referenced. flush hands both to the kernel in one gather write
+// (sendmsg / WSASend) rather than copying the body in behind the head.
+// Capacity survives between responses, so a warmed-up connection serving
+// cached bodies does not allocate.
+class OutBuffer {
+public:
+    bool empty() const { return next_ == parts_.size(); }
+
+    void append(const char* data, size_t n) {
+        if (n == 0) return;
+        if (next_ < parts_.size() && !parts_.back().body &&
+            parts_.back().off + parts_.back().len == bytes_.size())
+            parts_.back().len += n;
+        else
+            parts_.push_back(Part{ bytes_.size(), n, nullptr });
+        bytes_.append(data, n);
+    }
+    template <size_t N>
+    void append(const char (&literal)[N]) { append(literal, N - 1); }
+    void append(const std::string& s) { append(s.data(), s.size()); }
+
+    void append(std::shared_ptr<const std::string> body) {
+        if (!body->empty()) parts_.push_back(Part{ 0, body->size(), std::move(body) });
+    }
+
+    // Sends until everything is out or the socket would block. False on
+    // any other error.
+    bool flush(socket_t s) {
+        while (!empty()) {
+            long n = gather_send(s);
+            if (n < 0) return would_block();
+            consume((size_t)n);
+        }
+        clear();
+        return true;
+    }
+
+    // Everything unsent as one string, for handing the socket elsewhere.
+    std::string take() {
+        std::string all;
+        for (size_t i = next_; i < parts_.size(); ++i)
+            all.append(data(parts_[i]) + (i == next_ ? sent_ : 0),
+                       parts_[i].len - (i == next_ ? sent_ : 0));
+        clear();
+        return all;
+    }
+
+    // Drops everything unsent, keeping the capacity.
+    void clear() {
+        bytes_.clear();
+        parts_.clear();
+        next_ = sent_ = 0;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (size_t i = next_; i < parts_.size(); ++i) n += parts_[i].len;
+        return n - sent_;
+    }
+
+private:
+    struct Part {
+        size_t off, len; // a range of bytes_ when body is null
+        std::shared_ptr<const std::string> body;
+    };
+
+    const char* data(const Part& p) const { return p.body ? p.body->data() : bytes_.data() + p.off; }
+
+    void consume(size_t n) {
+        while (n > 0) {
+            size_t left = parts_[next_].len - sent_;
+            if (n < left) { sent_ += n; return; }
+            n -= left;
+            parts_[next_++].body.reset();
+            sent_ = 0;
+        }
+    }
+
+    long gather_send(socket_t s) {
+        const int kMaxParts = 64;
+#ifdef _WIN32
+        WSABUF bufs[kMaxParts];
+#else
+        iovec bufs[kMaxParts];
+#endif
+        int count = 0;
+        for (size_t i = next_; i < parts_.size() && count < kMaxParts; ++i, ++count) {
+            size_t skip = i == next_ ? sent_ : 0;
+#ifdef _WIN32
+            bufs[count].buf = (char*)data(parts_[i]) + skip;
+            bufs[count].len = (ULONG)(parts_[i].len - skip);
+#else
+            bufs[count].iov_base = (void*)(data(parts_[i]) + skip);
+            bufs[count].iov_len = parts_[i].len - skip;
+#endif
+        }
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(s, bufs, (DWORD)count, &sent, 0, NULL, NULL) != 0) return -1;
+        return (long)sent;
+#else
+        msghdr msg{};
+        msg.msg_iov = bufs;
+        msg.msg_iovlen = count;
+        return (long)sendmsg(s, &msg, MSG_NOSIGNAL);
+#endif
+    }
+
+    static bool would_block() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+
+    std::string bytes_;
+    std::vector<Part> parts_;
+    size_t next_ = 0; // first part not fully sent
+    size_t sent_ = 0; // bytes of parts_[next_] already sent
+};
+
+const char kJsonType[] = "application/json";
+
+// Status line and headers of a 200 response with a `length`-byte body.
+// `extraHeader` is one more "Name: value" line, or empty.
+void http_ok_head(OutBuffer& out, size_t length, bool keepAlive, std::string_view etag,
+                  std::string_view contentType = kJsonType,
+                  std::string_view extraHeader = std::string_view()) {
+    char num[24];
+    auto res = std::to_chars(num, num + sizeof(num), length);
+    out.append("HTTP/1.1 200 OK\r\nContent-Type: ");
+    out.append(contentType.data(), contentType.size());
+    out.append("\r\nContent-Length: ");
+    out.append(num, res.ptr - num);
+    if (!etag.empty()) {
+        out.append("\r\nETag: ");
+        out.append(etag.data(), etag.size());
+    }
+    if (!extraHeader.empty()) {
+        out.append("\r\n");
+        out.append(extraHeader.data(), extraHeader.size());
+    }
+    if (keepAlive) out.append("\r\nConnection: keep-alive\r\n\r\n");
+    else out.append("\r\nConnection: close\r\n\r\n");
+}
+
+void http_ok(OutBuffer& out, std::shared_ptr<const std::string> body, bool keepAlive,
+             std::string_view etag = std::string_view(),
+             std::string_view extraHeader = std::string_view()) {
+    http_ok_head(out, body->size(), keepAlive, etag, kJsonType, extraHeader);
+    out.append(std::move(body));
+}
+
+void http_ok(OutBuffer& out, const std::string& body, bool keepAlive,
+             std::string_view contentType = kJsonType,
+             std::string_view extraHeader = std::string_view()) {
+    http_ok_head(out, body.size(), keepAlive, std::string_view(), contentType, extraHeader);
+    out.append(body);
+}
+
+// No body and so no Content-Length: a 304 never has one.
+void http_not_modified(OutBuffer& out, std::string_view etag, bool keepAlive,
+                       std::string_view extraHeader = std::string_view()) {
+    out.append("HTTP/1.1 304 Not Modified\r\nETag: ");
+    out.append(etag.data(), etag.size());
+    if (!extraHeader.empty()) {
+        out.append("\r\n");
+        out.append(extraHeader.data(), extraHeader.size());
+    }
+    if (keepAlive) out.append("\r\nConnection: keep-alive\r\n\r\n");
+    else out.append("\r\nConnection: close\r\n\r\n");
+}
+
+const char kBadRequest[] =
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// Overload shedding: the client should come back after Retry-After seconds.
+const char kServiceUnavailable[] =
+    "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+const char kInternalError[] =
+    "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+
+const size_t kMaxRequestBytes = 64 * 1024;
+const int kKeepAliveIdleSec = 60;
+const int kStreamPingSec = 15; // comment line on an otherwise quiet stream
+const size_t kMaxStreams = 256; // SSE + WebSocket subscribers, one thread each
+
+// Request line plus headers (names lower-cased).
+struct HttpRequest {
+    std::string method;
+    std::string path;   // target without the query string
+    std::string query;
+    std::vector<std::pair<std::string, std::string>> headers;
+    bool keepAlive = true;
+
+    const std::string* header(const char* name) const {
+        for (const auto& h : headers)
+            if (h.first == name) return &h.second;
+        return nullptr;
+    }
+};
+
+std::string lower(std::string s) {
+    for (char& ch : s) ch = (char)std::tolower((unsigned char)ch);
+    return s;
+}
+
+// Parses the request starting at buf[pos]. Returns the bytes it spans
+// (headers plus any Content-Length body), 0 if it has not fully arrived
+// yet, or -1 if it is malformed or too large. A Content-Length that is not
+// one plain number, or any Transfer-Encoding (no chunked bodies here), is
+// malformed: guessing where the body ends would read it as the next
+// pipelined request.
+long parse_request(const std::string& buf, size_t pos, HttpRequest& req) {
+    size_t end = buf.find("\r\n\r\n", pos);
+    if (end == std::string::npos)
+        return buf.size() - pos > kMaxRequestBytes ? -1 : 0;
+
+    size_t lineEnd = buf.find("\r\n", pos);
+    size_t sp1 = buf.find(' ', pos);
+    size_t sp2 = sp1 < lineEnd ? buf.find(' ', sp1 + 1) : std::string::npos;
+    if (sp1 >= lineEnd || sp2 >= lineEnd) return -1;
+
+    req.method = buf.substr(pos, sp1 - pos);
+    std::string target = buf.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string version = buf.substr(sp2 + 1, lineEnd - sp2 - 1);
+    size_t q = target.find('?');
+    req.path = target.substr(0, q);
+    req.query = q == std::string::npos ? "" : target.substr(q + 1);
+    req.keepAlive = version == "HTTP/1.1";
+
+    long contentLength = 0;
+    bool haveLength = false;
+    for (size_t h = lineEnd + 2; h < end + 2; ) {
+        size_t e = buf.find("\r\n", h);
+        size_t colon = buf.find(':', h);
+        if (colon < e) {
+            size_t v = buf.find_first_not_of(" \t", colon + 1);
+            std::string value = v < e ? buf.substr(v, e - v) : "";
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.pop_back();
+            req.headers.emplace_back(lower(buf.substr(h, colon - h)), value);
+
+            const std::string& name = req.headers.back().first;
+            if (name == "connection") {
+                std::string token = lower(value);
+                if (token.find("close") != std::string::npos) req.keepAlive = false;
+                else if (token.find("keep-alive") != std::string::npos) req.keepAlive = true;
+            } else if (name == "content-length") {
+                const char* last = value.data() + value.size();
+                auto res = std::from_chars(value.data(), last, contentLength);
+                if (haveLength || value.empty() || res.ec != std::errc() || res.ptr != last)
+                    return -1;
+                haveLength = true;
+            } else if (name == "transfer-encoding") {
+                return -1;
+            }
+        }
+        h = e + 2;
+    }
+    if (contentLength < 0 || contentLength > (long)kMaxRequestBytes) return -1;
+
+    size_t total = end + 4 - pos + contentLength;
+    return buf.size() - pos < total ? 0 : (long)total;
+}
+
+// The serialized body of the newest version any reader has asked for. The
+// first reader of a version serializes it under the lock; readers that
+// arrive meanwhile wait and then share the same immutable buffer.
+class BodyCache {
+public:
+    struct Entry {
+        unsigned long long version;
+        std::string body;
+    };
+
+    template <class Serialize>
+    std::shared_ptr<const Entry> get(unsigned long long version, Serialize&& serialize) {
+        auto cur = std::atomic_load(&entry_);
+        if (cur && cur->version >= version) return cur;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        cur = std::atomic_load(&entry_);
+        if (cur && cur->version >= version) return cur;
+        cur = std::make_shared<const Entry>(Entry{ version, serialize() });
+        std::atomic_store(&entry_, cur);
+        serializations_.fetch_add(1, std::memory_order_relaxed);
+        return cur;
+    }
+
+    unsigned long long serializations() const {
+        return serializations_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::mutex mutex_;
+    std::shared_ptr<const Entry> entry_;
+    std::atomic<unsigned long long> serializations_{0};
+};
+
+BodyCache gStateCache;
+BodyCache gStatsCache;
+
+std::shared_ptr<const BodyCache::Entry> cached_state() {
+    auto snap = std::atomic_load(&gFleetSnapshot);
+    return gStateCache.get(snap->version, [&] { return state_json(*snap); });
+}
+
+// Random per process, so a version saved against an earlier run never
+// matches this one.
+unsigned long long state_epoch() {
+    static const unsigned long long epoch =
+        ((unsigned long long)std::random_device{}() << 32) | std::random_device{}();
+    return epoch;
+}
+
+// "<epoch>-<version>" in hex: the /state?since= token and the ETag body.
+std::string state_version_token(unsigned long long version) {
+    char token[40];
+    std::snprintf(token, sizeof(token), "%llx-%llx", state_epoch(), version);
+    return token;
+}
+
+// False unless `token` came from state_version_token in this process.
+bool parse_version_token(const std::string& token, unsigned long long& version) {
+    size_t dash = token.find('-');
+    if (dash == std::string::npos || dash == 0 || dash + 1 == token.size()) return false;
+    char* end = nullptr;
+    if (std::strtoull(token.c_str(), &end, 16) != state_epoch() || end != token.c_str() + dash)
+        return false;
+    version = std::strtoull(token.c_str() + dash + 1, &end, 16);
+    return *end == '\0';
+}
+
+// Strong ETag for the /state body at `version`, formatted in place.
+struct StateEtag {
+    char text[40];
+    size_t size;
+
+    explicit StateEtag(unsigned long long version) {
+        size = (size_t)std::snprintf(text, sizeof(text), "\"%llx-%llx\"", state_epoch(), version);
+    }
+    std::string_view view() const { return std::string_view(text, size); }
+};
+
+// "X-Sim-Time-Ms: <simulated ms now>". A /state body is made once per
+// version and its remainingMs count from the body's "asOfMs"; the
+// difference to this header is how far they have run down since.
+struct SimTimeHeader {
+    char text[48];
+    size_t size;
+
+    SimTimeHeader() {
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            gPacer.now().time_since_epoch()).count();
+        size = (size_t)std::snprintf(text, sizeof(text), "X-Sim-Time-Ms: %lld", ms);
+    }
+    std::string_view view() const { return std::string_view(text, size); }
+};
+
+// Body for /state?since=TOKEN: only the cars that changed after TOKEN's
+// version, or a full resync if TOKEN is from another run or older than
+// gStateLog reaches.
+std::string state_delta(const std::string& since) {
+    auto snap = std::atomic_load(&gFleetSnapshot);
+    std::vector<char> changed(snap->cars.size(), 0);
+    unsigned long long from = 0;
+    bool delta = parse_version_token(since, from) && from <= snap->version &&
+                 gStateLog.changed_between(from, snap->version, changed);
+    return state_delta_json(*snap, state_version_token(snap->version), delta ? &changed : nullptr);
+}
+
+// One Server-Sent Events message; `data` must not contain a newline.
+std::string sse_message(const char* event, const std::string& data) {
+    return std::string("event: ") + event + "\ndata: " + data + "\n\n";
+}
+
+// Appends `bytes` bytes of v, least significant first.
+void put_le(std::string& out, unsigned long long v, int bytes) {
+    for (int i = 0; i < bytes; ++i) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+// Packed /state/ws payload; the layout is in the header comment. Every
+// car with "full" type when `changed` is null, otherwise only the flagged
+// ones.
+std::string binary_state(const FleetSnapshot& snap, const std::vector<char>* changed) {
+    size_t count = 0;
+    for (size_t i = 0; i < snap.cars.size(); ++i)
+        if (!changed || (*changed)[i]) count++;
+
+    std::string out;
+    out.reserve(24 + 16 * count);
+    put_le(out, changed ? 2 : 1, 1);
+    put_le(out, 2, 1);
+    put_le(out, count, 2);
+    put_le(out, snap.floors, 4);
+    put_le(out, snap.version, 8);
+    put_le(out, (unsigned long long)as_of_ms(snap), 8);
+    for (size_t i = 0; i < snap.cars.size(); ++i) {
+        if (changed && !(*changed)[i]) continue;
+        const CarSnapshot& e = snap.cars[i];
+        long long remainingMs =
+            std::chrono::duration_cast<std::chrono::milliseconds>(e.stateEndTime - snap.at).count();
+        put_le(out, e.id, 2);
+        put_le(out, e.currentFloor, 2);
+        put_le(out, e.targetFloor, 2);
+        put_le(out, (unsigned long long)(long long)e.direction, 1);
+        put_le(out, (unsigned)e.state, 1);
+        put_le(out, e.load, 2);
+        put_le(out, e.capacity, 2);
+        put_le(out, std::max(0LL, remainingMs), 4);
+    }
+    return out;
+}
+
+const int kWsClose = 0x8;
+const int kWsPing = 0x9;
+const int kWsPong = 0xA;
+const int kWsBinary = 0x2;
+
+// One unmasked, unfragmented server frame.
+std::string ws_frame(int opcode, const std::string& payload) {
+    std::string out;
+    out += (char)(0x80 | opcode);
+    if (payload.size() < 126) {
+        out += (char)payload.size();
+    } else if (payload.size() < 65536) {
+        out += (char)126;
+        out += (char)(payload.size() >> 8);
+        out += (char)(payload.size() & 0xff);
+    } else {
+        out += (char)127;
+        for (int i = 7; i >= 0; --i) out += (char)(((unsigned long long)payload.size() >> (8 * i)) & 0xff);
+    }
+    return out + payload;
+}
+
+// 20-byte SHA-1 digest, needed only for Sec-WebSocket-Accept.
+std::string sha1(const std::string& data) {
+    auto rotl = [](std::uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    std::uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    std::string msg = data;
+    msg += (char)0x80;
+    while (msg.size() % 64 != 56) msg += (char)0;
+    for (int i = 7; i >= 0; --i) msg += (char)(((unsigned long long)data.size() * 8) >> (8 * i));
+
+    for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+        std::uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            const unsigned char* b = (const unsigned char*)msg.data() + chunk + 4 * i;
+            w[i] = (std::uint32_t)b[0] << 24 | (std::uint32_t)b[1] << 16 | (std::uint32_t)b[2] << 8 | b[3];
+        }
+        for (int i = 16; i < 80; ++i) w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            std::uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            std::uint32_t t = rotl(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rotl(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    std::string digest;
+    for (std::uint32_t v : h)
+        for (int shift = 24; shift >= 0; shift -= 8) digest += (char)(v >> shift);
+    return digest;
+}
+
+std::string base64(const std::string& data) {
+    static const char kAlphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        std::uint32_t n = (std::uint32_t)(unsigned char)data[i] << 16;
+        if (i + 1 < data.size()) n |= (std::uint32_t)(unsigned char)data[i + 1] << 8;
+        if (i + 2 < data.size()) n |= (unsigned char)data[i + 2];
+        out += kAlphabet[(n >> 18) & 63];
+        out += kAlphabet[(n >> 12) & 63];
+        out += i + 1 < data.size() ? kAlphabet[(n >> 6) & 63] : '=';
+        out += i + 2 < data.size() ? kAlphabet[n & 63] : '=';
+    }
+    return out;
+}
+
+// 101 Switching Protocols for a valid RFC 6455 upgrade request, or empty.
+std::string websocket_handshake(const HttpRequest& req) {
+    const std::string* upgrade = req.header("upgrade");
+    const std::string* connection = req.header("connection");
+    const std::string* key = req.header("sec-websocket-key");
+    const std::string* version = req.header("sec-websocket-version");
+    if (req.method != "GET" || !upgrade || lower(*upgrade) != "websocket" || !connection ||
+        lower(*connection).find("upgrade") == std::string::npos || !key || key->empty() ||
+        !version || *version != "13")
+        return std::string();
+
+    std::string accept = base64(sha1(*key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    return "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Accept: " + accept + "\r\n\r\n";
+}
+
+// Value of query parameter `name` (not URL-decoded); false if absent.
+bool query_param(const std::string& query, const char* name, std::string& value) {
+    size_t len = std::strlen(name);
+    for (size_t pos = 0; pos <= query.size(); ) {
+        size_t amp = std::min(query.find('&', pos), query.size());
+        if (query.compare(pos, len, name) == 0 && pos + len < amp && query[pos + len] == '=') {
+            value = query.substr(pos + len + 1, amp - pos - len - 1);
+            return true;
+        }
+        pos = amp + 1;
+    }
+    return false;
+}
+
+// True if an If-None-Match value is "*" or lists `etag`. If-None-Match
+// compares weakly, so a W/ prefix on the client's copy is ignored.
+bool etag_matches(const std::string& header, std::string_view etag) {
+    size_t pos = 0;
+    while (pos < header.size()) {
+        size_t comma = std::min(header.find(',', pos), header.size());
+        size_t b = header.find_first_not_of(" \t", pos);
+        if (b < comma) {
+            size_t e = header.find_last_not_of(" \t", comma - 1);
+            std::string tag = header.substr(b, e + 1 - b);
+            if (tag.compare(0, 2, "W/") == 0) tag.erase(0, 2);
+            if (tag == "*" || tag == etag) return true;
+        }
+        pos = comma + 1;
+    }
+    return false;
+}
+
+std::shared_ptr<const BodyCache::Entry> cached_stats() {
+    auto snap = std::atomic_load(&gStatsSnapshot);
+    return gStatsCache.get(snap->version, [&] { return stats_json(*snap); });
+}
+
+// The cached body itself, kept alive by its cache entry.
+std::shared_ptr<const std::string> shared_body(std::shared_ptr<const BodyCache::Entry> entry) {
+    const std::string* body = &entry->body;
+    return std::shared_ptr<const std::string>(std::move(entry), body);
+}
+
+// A fixed set of worker threads serving connections handed over by the
+// accept loop. At most `depth` accepted connections wait for a worker;
+// admit() refuses any beyond that, so a burst of clients costs a bounded
+// number of threads and bytes rather than a thread each.
+class WorkerPool {
+public:
+    void start(int workers, size_t depth) {
+        workers_ = workers;
+        depth_ = depth;
+        for (int i = 0; i < workers; ++i)
+            std::thread([this] { run(); }).detach();
+    }
+
+    bool admit(socket_t c) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.size() >= depth_) {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            queue_.push_back({ c, WallClock::now() });
+            waiting_.store(queue_.size(), std::memory_order_relaxed);
+        }
+        ready_.notify_one();
+        return true;
+    }
+
+    // Connections accepted but not yet picked up by a worker.
+    size_t waiting() const { return waiting_.load(std::memory_order_relaxed); }
+    int workers() const { return workers_; }
+    size_t depth() const { return depth_; }
+
+    unsigned long long served() const { return served_.load(std::memory_order_relaxed); }
+    unsigned long long rejected() const { return rejected_.load(std::memory_order_relaxed); }
+    // Time from accept to a worker picking the connection up.
+    double mean_wait_ms() const {
+        unsigned long long n = served();
+        return n ? waitNs_.load(std::memory_order_relaxed) / 1e6 / n : 0.0;
+    }
+    double max_wait_ms() const { return maxWaitNs_.load(std::memory_order_relaxed) / 1e6; }
+
+private:
+    struct Queued {
+        socket_t socket;
+        WallClock::time_point accepted;
+    };
+
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Queued> queue_;
+    int workers_ = 0;
+    size_t depth_ = 0;
+    std::atomic<size_t> waiting_{0};
+    std::atomic<unsigned long long> served_{0}, rejected_{0}, waitNs_{0}, maxWaitNs_{0};
+};
+
+WorkerPool gWorkers;
+
+// Prometheus text exposition: one "# TYPE" line, then the samples.
+void write_metric_type(JsonWriter& w, const char* name, const char* type, const char* help) {
+    w.raw("# HELP ").raw(name, std::strlen(name)).raw(" ").raw(help, std::strlen(help))
+     .raw("\n# TYPE ").raw(name, std::strlen(name)).raw(" ").raw(type, std::strlen(type))
+     .raw("\n");
+}
+
+// Cumulative _bucket samples plus _sum and _count. `labels` is either
+// empty or a complete `key="value"` list without braces.
+void write_histogram(JsonWriter& w, const char* name, const std::string& labels,
+                     const Metrics::Histogram& h) {
+    size_t nameLen = std::strlen(name);
+    unsigned long long cumulative = 0;
+    for (int b = 0; b < kLatencyBuckets; ++b) {
+        cumulative += h.buckets[b];
+        w.raw(name, nameLen).raw("_bucket{");
+        if (!labels.empty()) w.raw(labels).raw(",");
+        w.raw("le=\"");
+        if (b < kLatencyBuckets - 1) w.num(kLatencyBoundsNs[b] / 1e9);
+        else w.raw("+Inf");
+        w.raw("\"} ").num(cumulative).raw("\n");
+    }
+    std::string braced = labels.empty() ? std::string() : "{" + labels + "}";
+    w.raw(name, nameLen).raw("_sum").raw(braced).raw(" ").num(h.sumNs / 1e9).raw("\n");
+    w.raw(name, nameLen).raw("_count").raw(braced).raw(" ").num(cumulative).raw("\n");
+}
+
+// GET /metrics. Counters come from gMetrics; gauges are read from the
+// published snapshots and hubs, so a scrape never touches gMutex.
+std::string metrics_text() {
+    Metrics::Totals t = gMetrics.totals();
+    JsonWriter& w = scratch_writer();
+
+    write_metric_type(w, "sim_http_requests_total", "counter",
+                      "HTTP requests answered, by route and status code.");
+    for (int r = 0; r < Metrics::kRoutes; ++r)
+        for (int c = 0; c < (Metrics::other_code(r) ? 2 : 1); ++c) {
+            w.raw("sim_http_requests_total{route=\"").raw(Metrics::route_name(r),
+                                                           std::strlen(Metrics::route_name(r)));
+            const char* code = c ? Metrics::other_code(r) : "200";
+            w.raw("\",code=\"").raw(code, std::strlen(code)).raw("\"} ")
+             .num(t.requests[r][c]).raw("\n");
+        }
+    write_metric_type(w, "sim_http_request_duration_seconds", "histogram",
+                      "Time to route a request and assemble its response, socket I/O excluded.");
+    for (int r = 0; r < Metrics::kRoutes; ++r)
+        write_histogram(w, "sim_http_request_duration_seconds",
+                        std::string("route=\"") + Metrics::route_name(r) + "\"", t.latency[r]);
+    write_metric_type(w, "sim_http_bad_requests_total", "counter",
+                      "Requests answered 400 and closed.");
+    w.raw("sim_http_bad_requests_total ").num(t.badRequests).raw("\n");
+
+    write_metric_type(w, "sim_tick_duration_seconds", "histogram",
+                      "One simulation step: running the due events and publishing snapshots.");
+    write_histogram(w, "sim_tick_duration_seconds", "", t.tick);
+    write_metric_type(w, "sim_mutex_wait_seconds", "histogram", "Time spent waiting for gMutex.");
+    write_histogram(w, "sim_mutex_wait_seconds", "", t.lockWait);
+    write_metric_type(w, "sim_mutex_hold_seconds", "histogram", "Time gMutex was held.");
+    write_histogram(w, "sim_mutex_hold_seconds", "", t.lockHold);
+
+    auto fleet = std::atomic_load(&gFleetSnapshot);
+    auto stats = std::atomic_load(&gStatsSnapshot);
+    write_metric_type(w, "sim_passengers_waiting", "gauge",
+                      "Passengers queued at hall calls, by direction.");
+    w.raw("sim_passengers_waiting{direction=\"up\"} ").num(stats ? stats->waitingUp : 0)
+     .raw("\nsim_passengers_waiting{direction=\"down\"} ").num(stats ? stats->waitingDown : 0)
+     .raw("\n");
+    write_metric_type(w, "sim_state_version", "gauge", "Current /state version.");
+    w.raw("sim_state_version ").num(fleet ? fleet->version : 0ULL).raw("\n");
+
+    write_metric_type(w, "sim_connections_accepted_total", "counter",
+                      "Connections accepted by either front end.");
+    w.raw("sim_connections_accepted_total ").num(t.accepted).raw("\n");
+    write_metric_type(w, "sim_connections_open", "gauge",
+                      "Connections accepted and not yet closed, streams included.");
+    w.raw("sim_connections_open ").num(t.open).raw("\n");
+    write_metric_type(w, "sim_streams_open", "gauge", "Subscribers to /state/stream and /state/ws.");
+    w.raw("sim_streams_open{protocol=\"sse\"} ").num(gStreamHub.size())
+     .raw("\nsim_streams_open{protocol=\"websocket\"} ").num(gSocketHub.size()).raw("\n");
+    write_metric_type(w, "sim_streams_refused_total", "counter",
+                      "Stream requests answered 503 because kMaxStreams were open.");
+    w.raw("sim_streams_refused_total ").num(t.streamsRefused).raw("\n");
+
+    write_metric_type(w, "sim_workers", "gauge", "Worker threads of the --io threads front end.");
+    w.raw("sim_workers ").num(gWorkers.workers()).raw("\n");
+    write_metric_type(w, "sim_worker_queue_length", "gauge",
+                      "Accepted connections waiting for a worker.");
+    w.raw("sim_worker_queue_length ").num(gWorkers.waiting()).raw("\n");
+    write_metric_type(w, "sim_worker_queue_rejected_total", "counter",
+                      "Connections answered 503 because the worker queue was full.");
+    w.raw("sim_worker_queue_rejected_total ").num(gWorkers.rejected()).raw("\n");
+    write_metric_type(w, "sim_worker_queue_wait_seconds", "histogram",
+                      "Time from accept until a worker picked the connection up.");
+    write_histogram(w, "sim_worker_queue_wait_seconds", "", t.queueWait);
+    return w.str();
+}
+
+const char kPrometheusType[] = "text/plain; version=0.0.4; charset=utf-8";
+
+// Where POST /admin/checkpoint writes (--checkpoint); empty leaves the
+// route unregistered, so no client can write files unless asked to.
+std::string gCheckpointPath;
+
+// POST /admin/checkpoint: the one request that takes gMutex, for as long as
+// serializing the building takes (a sequential copy, well under a tick for
+// 128 cars); the file is written after letting go. Returns false if it
+// answered 500.
+bool admin_checkpoint(OutBuffer& out, bool keepAlive) {
+    static std::mutex fileMutex; // one writer of PATH.tmp at a time
+    std::lock_guard<std::mutex> file(fileMutex);
+    auto started = WallClock::now();
+    std::string bytes;
+    TimePoint at;
+    unsigned long long version;
+    {
+        TimedLock lock(gMutex);
+        at = std::max(gSim.now, gPacer.now());
+        bytes = save_checkpoint(gSim, at);
+        version = gSim.stateVersion;
+    }
+    std::string error;
+    if (!write_file(gCheckpointPath, bytes, error)) {
+        std::cerr << "checkpoint: " << error << "\n";
+        out.append(kInternalError);
+        return false;
+    }
+    JsonWriter& w = scratch_writer();
+    w.raw("{\"bytes\":").num(bytes.size())
+     .raw(",\"simSec\":").num(std::chrono::duration<double>(at.time_since_epoch()).count())
+     .raw(",\"stateVersion\":").num(version)
+     .raw(",\"ms\":").num(std::chrono::duration<double, std::milli>(WallClock::now() - started).count())
+     .raw("}");
+    http_ok(out, w.str(), keepAlive);
+    return true;
+}
+
+// Appends the full HTTP response for one request and records it in
+// gMetrics.
+void route_request(const HttpRequest& req, OutBuffer& out) {
+    auto started = WallClock::now();
+    Metrics::Route route = Metrics::kRouteOther;
+    bool other = false; // answered Metrics::other_code(route) rather than 200
+    std::string since;
+    if (req.method == "GET" && req.path == "/state" && query_param(req.query, "since", since)) {
+        route = Metrics::kRouteStateDelta;
+        http_ok(out, state_delta(since), req.keepAlive, kJsonType, SimTimeHeader().view());
+    } else if (req.method == "GET" && req.path == "/state") {
+        route = Metrics::kRouteState;
+        auto entry = cached_state();
+        StateEtag etag(entry->version);
+        const std::string* ifNoneMatch = req.header("if-none-match");
+        bool notModified = ifNoneMatch && etag_matches(*ifNoneMatch, etag.view());
+        other = notModified;
+        SimTimeHeader simTime;
+        if (notModified) http_not_modified(out, etag.view(), req.keepAlive, simTime.view());
+        else http_ok(out, shared_body(std::move(entry)), req.keepAlive, etag.view(), simTime.view());
+    } else if (req.method == "GET" && req.path.compare(0, 6, "/stats") == 0) {
+        route = Metrics::kRouteStats;
+        http_ok(out, shared_body(cached_stats()), req.keepAlive);
+    } else if (req.method == "GET" && req.path == "/metrics") {
+        route = Metrics::kRouteMetrics;
+        http_ok(out, metrics_text(), req.keepAlive, kPrometheusType);
+    } else if (req.method == "POST" && req.path == "/admin/checkpoint" &&
+               !gCheckpointPath.empty()) {
+        route = Metrics::kRouteCheckpoint;
+        other = !admin_checkpoint(out, req.keepAlive);
+    } else {
+        static const std::string kNotFound = "{\"error\":\"not found\"}";
+        http_ok(out, kNotFound, req.keepAlive);
+    }
+    gMetrics.request(route, other, WallClock::now() - started);
+}
+
+// What a connection does once `out` from serve_buffered is flushed.
+enum class NextStep {
+    Read,   // wait for more requests
+    Close,
+    EventStream, // hand the socket to stream_to: SSE
+    WebSocket,   // hand the socket to stream_to: binary frames
+};
+
+// How the HTTP front end runs: epoll loops on `threads` threads, or the
+// portable accept loop with a pool of `workers` and at most `queueDepth`
+// connections waiting for one.
+struct ServerParams {
+    bool useEpoll = true;
+    int threads = 1;
+    int workers = 64;
+    int queueDepth = 256;
+};
+
+const char kEventStreamHeaders[] =
+    "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n\r\n";
+
+// Answers every complete request buffered in `in`, in order (pipelining):
+// responses are appended to `out` and the consumed bytes dropped from
+// `in`. A /state/stream or /state/ws request ends the exchange; anything
+// after it is discarded. With keepAlive false the next response carries
+// Connection: close and ends the exchange too.
+NextStep serve_buffered(std::string& in, OutBuffer& out, bool keepAlive = true) {
+    size_t pos = 0;
+    NextStep next = NextStep::Read;
+    while (next == NextStep::Read) {
+        HttpRequest req;
+        long n = parse_request(in, pos, req);
+        if (n == 0) break;
+        if (n < 0) {
+            gMetrics.bad_request();
+            out.append(kBadRequest);
+            next = NextStep::Close;
+            break;
+        }
+        pos += n;
+        if ((req.path == "/state/stream" || req.path == "/state/ws") &&
+            gStreamHub.size() + gSocketHub.size() >= kMaxStreams) {
+            gMetrics.stream_refused();
+            out.append(kServiceUnavailable);
+            next = NextStep::Close;
+            break;
+        }
+        if (req.method == "GET" && req.path == "/state/stream") {
+            out.append(kEventStreamHeaders);
+            next = NextStep::EventStream;
+            break;
+        }
+        if (req.path == "/state/ws") {
+            std::string accept = websocket_handshake(req);
+            if (accept.empty()) out.append(kBadRequest);
+            else out.append(accept);
+            next = accept.empty() ? NextStep::Close : NextStep::WebSocket;
+            break;
+        }
+        req.keepAlive = req.keepAlive && keepAlive;
+        route_request(req, out);
+        if (!req.keepAlive) next = NextStep::Close;
+    }
+    in.erase(0, pos);
+    return next;
+}
+
+bool net_startup() {
+#ifdef _WIN32
+    WSADATA w;
+    if (WSAStartup(MAKEWORD(2,2), &w) != 0) {
+        std::cerr << "WSAStartup failed\n";
+        return false;
+    }
+#else
+    signal(SIGPIPE, SIG_IGN); // a client hanging up mid-send is not fatal
+#endif
+    return true;
+}
+
+void net_cleanup() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+// Listening socket on all interfaces; port 0 picks a free port (see
+// bound_port). kInvalidSocket on failure.
+socket_t open_listener(int port) {
+    socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == kInvalidSocket) return kInvalidSocket;
+
+    int yes = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, SOMAXCONN) != 0) {
+        close_socket(s);
+        return kInvalidSocket;
+    }
+    return s;
+}
+
+int bound_port(socket_t s) {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    getsockname(s, (sockaddr*)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+bool send_all(socket_t s, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(s, data.data() + sent, (int)(data.size() - sent), 0);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+void set_send_timeout(socket_t s, int seconds) {
+#ifdef _WIN32
+    DWORD ms = seconds * 1000;
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&ms, sizeof(ms));
+#else
+    timeval tv{};
+    tv.tv_sec = seconds;
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+// True if recv on `c` would not block (data, EOF or an error waiting),
+// waiting up to `timeoutMs` for that to become so.
+bool readable(socket_t c, int timeoutMs = 0) {
+    PollFd p{};
+    p.fd = c;
+    p.events = kPollIn;
+    return poll_sockets(&p, 1, timeoutMs) > 0;
+}
+
+// Handles whatever a streaming client has sent, without blocking. SSE
+// clients send nothing, so anything is discarded; WebSocket pings get a
+// pong and a close frame is echoed. False once the connection is done.
+bool service_stream_client(socket_t c, bool webSocket, std::string& in) {
+    char buf[4096];
+    while (readable(c)) {
+        int n = recv(c, buf, sizeof(buf), 0);
+        if (n <= 0) return false;
+        if (webSocket) in.append(buf, n);
+        if (in.size() > kMaxRequestBytes) return false;
+    }
+
+    while (in.size() >= 2) {
+        unsigned char b0 = (unsigned char)in[0], b1 = (unsigned char)in[1];
+        size_t len = b1 & 0x7f, at = 2;
+        if (len == 126) {
+            if (in.size() < 4) break;
+            len = (size_t)(unsigned char)in[2] << 8 | (unsigned char)in[3];
+            at = 4;
+        } else if (len == 127) {
+            if (in.size() < 10) break;
+            len = 0;
+            for (int i = 0; i < 8; ++i) len = len << 8 | (unsigned char)in[2 + i];
+            at = 10;
+        }
+        if (!(b1 & 0x80) || len > kMaxRequestBytes) return false; // clients must mask
+        if (in.size() < at + 4 + len) break;
+
+        std::string payload = in.substr(at + 4, len);
+        for (size_t i = 0; i < len; ++i) payload[i] ^= in[at + i % 4];
+        in.erase(0, at + 4 + len);
+
+        int opcode = b0 & 0x0f;
+        if (opcode == kWsClose) {
+            send_all(c, ws_frame(kWsClose, payload.substr(0, 2)));
+            return false;
+        }
+        if (opcode == kWsPing && !send_all(c, ws_frame(kWsPong, payload))) return false;
+    }
+    return true;
+}
+
+// Owns its socket from here on: sends `pending` (the rest of the response
+// headers), then a full resync followed by every published message, until
+// the client goes away. Runs on its own thread, so a slow reader blocks
+// nobody but itself while its queue fills. `protocol` is
+// NextStep::EventStream or NextStep::WebSocket.
+void stream_to(socket_t c, std::string pending, NextStep protocol) {
+    bool webSocket = protocol == NextStep::WebSocket;
+    StreamHub& hub = webSocket ? gSocketHub : gStreamHub;
+    set_send_timeout(c, kKeepAliveIdleSec);
+    auto sub = hub.subscribe();
+
+    bool ok = send_all(c, pending);
+    std::string in;
+    std::vector<std::shared_ptr<const std::string>> batch;
+    auto lastSend = WallClock::now();
+    while (ok) {
+        bool resync;
+        {
+            // wake at least once a second to answer the client
+            std::unique_lock<std::mutex> lock(sub->mutex);
+            sub->ready.wait_for(lock, std::chrono::seconds(1),
+                                [&] { return sub->resync || !sub->queue.empty(); });
+            resync = sub->resync;
+            sub->resync = false;
+            batch.assign(sub->queue.begin(), sub->queue.end());
+            sub->queue.clear();
+        }
+
+        auto now = WallClock::now();
+        if (resync) {
+            // the newest snapshot already covers whatever was queued
+            auto snap = std::atomic_load(&gFleetSnapshot);
+            ok = send_all(c, webSocket ? ws_frame(kWsBinary, binary_state(*snap, nullptr))
+                                       : sse_message("resync", state_delta_json(
+                                             *snap, state_version_token(snap->version), nullptr)));
+            lastSend = now;
+        } else if (!batch.empty()) {
+            for (size_t i = 0; ok && i < batch.size(); ++i) ok = send_all(c, *batch[i]);
+            lastSend = now;
+        } else if (now - lastSend >= std::chrono::seconds(kStreamPingSec)) {
+            ok = send_all(c, webSocket ? ws_frame(kWsPing, "") : std::string(": ping\n\n"));
+            lastSend = now;
+        }
+        if (ok) ok = service_stream_client(c, webSocket, in);
+    }
+    hub.unsubscribe(sub);
+    close_socket(c);
+    gMetrics.connection_closed();
+}
+
+// A pooled connection keeps its worker while others queue for at most
+// this long busy, or this long idle.
+const int kWorkerSliceMs = 250;
+const int kRefusedLingerMs = 1000;
+const size_t kMaxRefused = 1024; // lingering 503s; past this they close at once
+
+// Blocking keep-alive connection: requests may arrive split across any
+// number of recv calls or several per segment. A connection gives its
+// worker back after kKeepAliveIdleSec idle, or once other connections are
+// waiting and it has had kWorkerSliceMs: idle, it is closed; busy, its next
+// response says Connection: close. Either way the client reconnects and
+// queues behind the others. Streams leave the pool for a thread of their
+// own (at most kMaxStreams).
+void handle_client(socket_t c) {
+    std::string in;
+    OutBuffer out;
+    char buf[4096];
+    const auto slice = std::chrono::milliseconds(kWorkerSliceMs);
+    auto start = WallClock::now(), lastActive = start;
+    NextStep next = NextStep::Read;
+    while (next == NextStep::Read) {
+        if (!readable(c, kWorkerSliceMs)) {
+            auto idle = WallClock::now() - lastActive;
+            if (idle >= std::chrono::seconds(kKeepAliveIdleSec)) break;
+            if (gWorkers.waiting() > 0 && idle >= slice) break;
+            continue;
+        }
+        int n = recv(c, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        in.append(buf, n);
+        lastActive = WallClock::now();
+
+        bool yield = gWorkers.waiting() > 0 && lastActive - start >= slice;
+        next = serve_buffered(in, out, !yield);
+        if (next == NextStep::EventStream || next == NextStep::WebSocket) {
+            std::thread(stream_to, c, out.take(), next).detach();
+            return;
+        }
+        if (!out.flush(c) || !out.empty()) break;
+    }
+    close_socket(c);
+    gMetrics.connection_closed();
+}
+
+void WorkerPool::run() {
+    while (true) {
+        Queued job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return !queue_.empty(); });
+            job = queue_.front();
+            queue_.pop_front();
+            waiting_.store(queue_.size(), std::memory_order_relaxed);
+        }
+        auto waited = WallClock::now() - job.accepted;
+        gMetrics.queue_wait(waited);
+        unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count();
+        served_.fetch_add(1, std::memory_order_relaxed);
+        waitNs_.fetch_add(ns, std::memory_order_relaxed);
+        unsigned long long prev = maxWaitNs_.load(std::memory_order_relaxed);
+        while (ns > prev && !maxWaitNs_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+        handle_client(job.socket);
+    }
+}
+
+// Accept loop feeding `workers` pooled threads. A connection that finds
+// `depth` others already queued is answered 503 with Retry-After from this
+// thread. It is only half-closed at first: closing with the request still
+// unread would reset the connection and lose the 503, so it lingers until
+// the request or the client's FIN arrives, or kRefusedLingerMs pass.
+void serve_threads(socket_t listener, int workers, int depth) {
+    gWorkers.start(workers, (size_t)depth);
+
+    struct Refused {
+        socket_t socket;
+        WallClock::time_point deadline;
+    };
+    std::vector<Refused> refused;
+    std::vector<PollFd> fds;
+    char sink[4096];
+    while (true) {
+        fds.assign(1 + refused.size(), PollFd{});
+        fds[0].fd = listener;
+        for (size_t i = 0; i < refused.size(); ++i) fds[i + 1].fd = refused[i].socket;
+        for (PollFd& p : fds) p.events = kPollIn;
+        poll_sockets(fds.data(), fds.size(), refused.empty() ? -1 : 100);
+
+        auto now = WallClock::now();
+        size_t kept = 0;
+        for (size_t i = 0; i < refused.size(); ++i) {
+            socket_t c = refused[i].socket;
+            if (fds[i + 1].revents == 0 && now < refused[i].deadline) {
+                refused[kept++] = refused[i];
+                continue;
+            }
+            while (readable(c) && recv(c, sink, sizeof(sink), 0) > 0) {}
+            close_socket(c);
+            gMetrics.connection_closed();
+        }
+        refused.resize(kept);
+
+        if (fds[0].revents == 0) continue;
+        socket_t c = accept(listener, NULL, NULL);
+        if (c == kInvalidSocket) continue;
+        gMetrics.connection_opened();
+        if (gWorkers.admit(c)) continue;
+        send_all(c, kServiceUnavailable);
+        shutdown(c, kShutdownSend);
+        if (refused.size() < kMaxRefused) {
+            refused.push_back({ c, now + std::chrono::milliseconds(kRefusedLingerMs) });
+        } else {
+            close_socket(c);
+            gMetrics.connection_closed();
+        }
+    }
+}
+
+#ifdef __linux__
+// One epoll event loop. Every loop watches the shared non-blocking
+// listener (EPOLLEXCLUSIVE wakes only one of them per connection) and owns
+// the connections it accepts, so a request never changes threads.
+// Connections stay open between requests; one idle for kKeepAliveIdleSec
+// is closed.
+void epoll_loop(socket_t listener) {
+    struct Conn {
+        std::string in;
+        OutBuffer out;
+        bool closing = false;
+        NextStep stream = NextStep::Read; // EventStream/WebSocket: hand off to stream_to
+        unsigned events = 0;
+        WallClock::time_point lastActive;
+    };
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event lev{};
+    lev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    lev.data.fd = listener;
+    epoll_ctl(ep, EPOLL_CTL_ADD, listener, &lev);
+
+    std::unordered_map<int, Conn> conns;
+    epoll_event events[256];
+    char buf[16384];
+    auto lastSweep = WallClock::now();
+    const auto idleLimit = std::chrono::seconds(kKeepAliveIdleSec);
+
+    auto watch = [&](int fd, Conn& conn, unsigned want) {
+        if (conn.events == want) return;
+        epoll_event cev{};
+        cev.events = want;
+        cev.data.fd = fd;
+        epoll_ctl(ep, conn.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &cev);
+        conn.events = want;
+    };
+    auto drop = [&](int fd) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        conns.erase(fd);
+        gMetrics.connection_closed();
+    };
+
+    while (true) {
+        int n = epoll_wait(ep, events, 256, 1000);
+        auto now = WallClock::now();
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == listener) {
+                int c;
+                while ((c = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    gMetrics.connection_opened();
+                    Conn& conn = conns[c];
+                    conn.lastActive = now;
+                    watch(c, conn, EPOLLIN | EPOLLRDHUP);
+                }
+                continue;
+            }
+
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            Conn& conn = it->second;
+            conn.lastActive = now;
+
+            if (conn.out.empty() && !conn.closing) {
+                // At most kMaxRequestBytes per wake: serve_buffered gets to
+                // enforce the limit, and a fast sender cannot hold the loop.
+                // The rest stays in the socket and wakes us again.
+                size_t budget = kMaxRequestBytes;
+                while (budget > 0) {
+                    ssize_t got = recv(fd, buf, std::min(sizeof(buf), budget), 0);
+                    if (got > 0) {
+                        conn.in.append(buf, got);
+                        budget -= (size_t)got;
+                        continue;
+                    }
+                    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                    conn.closing = true; // peer closed or error
+                    break;
+                }
+                NextStep next = serve_buffered(conn.in, conn.out);
+                if (next == NextStep::Close) conn.closing = true;
+                if ((next == NextStep::EventStream || next == NextStep::WebSocket) && !conn.closing)
+                    conn.stream = next;
+            }
+
+            if (conn.stream != NextStep::Read) {
+                // leaves this loop for a blocking thread of its own
+                std::string pending = conn.out.take();
+                NextStep protocol = conn.stream;
+                epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+                conns.erase(it);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                std::thread(stream_to, fd, std::move(pending), protocol).detach();
+                continue;
+            }
+
+            if (!conn.out.flush(fd)) { drop(fd); continue; }
+            if (!conn.out.empty()) {
+                watch(fd, conn, EPOLLOUT); // stop reading until the backlog drains
+                continue;
+            }
+            if (conn.closing) drop(fd);
+            else watch(fd, conn, EPOLLIN | EPOLLRDHUP);
+        }
+
+        if (now - lastSweep >= std::chrono::seconds(1)) {
+            lastSweep = now;
+            std::vector<int> idle;
+            for (const auto& kv : conns)
+                if (now - kv.second.lastActive > idleLimit) idle.push_back(kv.first);
+            for (int fd : idle) drop(fd);
+        }
+    }
+}
+
+// `threads` epoll loops; the calling thread runs the last one.
+void serve_epoll(socket_t listener, int threads) {
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    for (int t = 1; t < threads; ++t)
+        std::thread(epoll_loop, listener).detach();
+    epoll_loop(listener);
+}
+#endif
+
+void serve(socket_t listener, const ServerParams& sp) {
+#ifdef __linux__
+    if (sp.useEpoll) { serve_epoll(listener, sp.threads); return; }
+#endif
+    serve_threads(listener, sp.workers, sp.queueDepth);
+}
+
+// "7" or "16,16,20": false unless every comma-separated item is an integer.
+bool parse_int_list(const std::string& text, std::vector<int>& out) {
+    out.clear();
+    size_t pos = 0;
+    while (true) {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos) end = text.size();
+        size_t a = pos, b = end;
+        while (a < b && std::isspace((unsigned char)text[a])) ++a;
+        while (b > a && std::isspace((unsigned char)text[b - 1])) --b;
+        int v = 0;
+        auto r = std::from_chars(text.data() + a, text.data() + b, v);
+        if (a == b || r.ec != std::errc() || r.ptr != text.data() + b) return false;
+        out.push_back(v);
+        if (end == text.size()) return true;
+        pos = end + 1;
+    }
+}
+
+// Sets one building parameter by its flag name without the dashes; false
+// for an unknown name or a malformed value.
+bool set_building_param(BuildingParams& bp, const std::string& name, const std::string& value) {
+    std::vector<int> list;
+    if (name == "dispatch") {
+        bp.dispatcher = value;
+        return !value.empty();
+    }
+    if (!parse_int_list(value, list)) return false;
+    if (name == "floors" && list.size() == 1) bp.floors = list[0];
+    else if (name == "cars" && list.size() == 1) bp.cars = list[0];
+    else if (name == "capacity" && list.size() == 1) { bp.capacity = list[0]; bp.capacities.clear(); }
+    else if (name == "capacity") bp.capacities = list;
+    else if (name == "start-floors") bp.startFloors = list;
+    else return false;
+    return true;
+}
+
+// --config: "name = value" lines naming building flags (floors, cars,
+// capacity, start-floors, dispatch); '#' starts a comment.
+bool load_building_config(const std::string& path, BuildingParams& bp, std::string& error) {
+    std::string text;
+    if (!read_file(path, text, error)) return false;
+    auto trim = [](const std::string& v) {
+        size_t a = v.find_first_not_of(" \t\r");
+        size_t b = v.find_last_not_of(" \t\r");
+        return a == std::string::npos ? std::string() : v.substr(a, b - a + 1);
+    };
+    std::istringstream lines(text);
+    std::string line;
+    for (int n = 1; std::getline(lines, line); ++n) {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (trim(line).empty()) continue;
+        if (eq == std::string::npos ||
+            !set_building_param(bp, trim(line.substr(0, eq)), trim(line.substr(eq + 1)))) {
+            error = path + ":" + std::to_string(n) + ": bad line '" + trim(line) + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Range checks, within what the wire formats carry (i16 floors and u16
+// cars and loads in /state/ws frames, u16 car indexes in the journal). A
+// single start floor applies to every car.
+bool check_building(BuildingParams& bp, std::string& error) {
+    if (bp.floors < 2 || bp.floors > 32767) error = "floors must be 2..32767";
+    else if (bp.cars < 1 || bp.cars > 65535) error = "cars must be 1..65535";
+    else if (!bp.capacities.empty() && (int)bp.capacities.size() != bp.cars)
+        error = "capacity takes one value, or one per car";
+    else if (bp.startFloors.size() > 1 && (int)bp.startFloors.size() != bp.cars)
+        error = "start-floors takes one floor, or one per car";
+    if (!error.empty()) return false;
+    if (bp.startFloors.size() == 1) bp.startFloors.assign(bp.cars, bp.startFloors[0]);
+    for (int c = 0; c < bp.cars; ++c) {
+        if (bp.capacity_of(c) < 1 || bp.capacity_of(c) > 65535) error = "capacity must be 1..65535";
+        else if (bp.start_floor(c) < 1 || bp.start_floor(c) > bp.floors)
+            error = "start floors must be 1.." + std::to_string(bp.floors);
+        if (!error.empty()) return false;
+    }
+    return true;
+}
+
+// Resets `sim` to the start-of-day building and arms the first events.
+// `stream` selects an independent RNG stream for the same seed.
+void init_building(Simulation& sim, const BuildingParams& bp,
+                   unsigned long long seed, unsigned stream) {
+    sim = Simulation{};
+    sim.floors = bp.floors;
+    sim.dispatcher = make_dispatcher(bp.dispatcher);
+    sim.dispatcherName = bp.dispatcher;
+    sim.seed = seed;
+
+    std::seed_seq seq{ (unsigned)(seed & 0xffffffffu), (unsigned)(seed >> 32), stream };
+    sim.rng.seed(seq);
+
+    sim.upQ.assign(sim.floors + 1, {});
+    sim.downQ.assign(sim.floors + 1, {});
+    sim.calls.reset(sim.floors);
+
+    for (int i = 0; i < bp.cars; ++i) {
+        TimePoint doorsClose = TimePoint{} + std::chrono::seconds(5);
+        int c = sim.fleet.add(i + 1, bp.start_floor(i), bp.capacity_of(i),
+                              ElevatorState::DoorOpen, doorsClose);
+        schedule(sim, doorsClose, EventKind::Elevator, c);
+    }
+    for (int fl = 1; fl <= sim.floors; ++fl)
+        schedule(sim, next_arrival_candidate(sim, TimePoint{}), EventKind::Arrival, fl);
+}
+
+// What a journal of this building starts with.
+JournalHeader journal_header(const BuildingParams& bp, unsigned long long seed) {
+    JournalHeader h{};
+    std::memcpy(h.magic, kJournalMagic, sizeof(h.magic));
+    h.version = 1;
+    h.recordSize = sizeof(JournalRecord);
+    h.floors = bp.floors;
+    h.cars = bp.cars;
+    h.capacity = bp.capacity_of(0);
+    h.seed = seed;
+    std::snprintf(h.dispatcher, sizeof(h.dispatcher), "%s", bp.dispatcher.c_str());
+    return h;
+}
+
+// Headless run: simulate `days` full days as fast as possible.
+// `restored`, if given, is moved in and carries on to the end of day `days`;
+// with `checkpointPath` set the final state is saved there.
+int run_batch(const BuildingParams& bp, int days, unsigned long long seed,
+              const JournalParams& jp, Simulation* restored, const std::string& checkpointPath) {
+    Simulation sim;
+    if (restored) sim = std::move(*restored);
+    else init_building(sim, bp, seed, 0);
+    unsigned long long eventsBefore = sim.eventCount;
+    Journal journal;
+    if (!jp.path.empty()) {
+        if (!journal.open(jp, journal_header(bp, seed))) return 1;
+        sim.journal = &journal;
+    }
+
+    auto wallStart = WallClock::now();
+    run_days(sim, days);
+    journal.close();
+    double wallSec = std::chrono::duration<double>(WallClock::now() - wallStart).count();
+
+    std::cout << stats_json(*take_stats_snapshot(sim)) << "\n";
+    unsigned long long events = sim.eventCount - eventsBefore;
+    std::cerr << "simulated " << days << " day(s): " << events << " events in "
+              << wallSec << " s (" << (wallSec > 0 ? events / wallSec : 0.0)
+              << " events/s)\n";
+    if (sim.journal)
+        std::cerr << "journal: " << journal.records() << " records ("
+                  << journal.records() * sizeof(JournalRecord) / 1e6 << " MB) in "
+                  << journal.segments() << " file(s)\n";
+    std::string error;
+    if (!checkpointPath.empty() && !write_file(checkpointPath, save_checkpoint(sim, sim.now), error)) {
+        std::cerr << "checkpoint: " << error << "\n";
+        return 1;
+    }
+    return journal.failed() ? 1 : 0;
+}
+
+// One journal file, read-only: mapped on POSIX, read whole elsewhere.
+// Trailing bytes short of a record are ignored.
+class JournalFile {
+public:
+    JournalFile() = default;
+    JournalFile(const JournalFile&) = delete;
+    JournalFile& operator=(const JournalFile&) = delete;
+    ~JournalFile() { close(); }
+
+    // False if the file cannot be opened; `error` is empty when it simply
+    // does not exist.
+    bool open(const std::string& path, std::string& error) {
+        close();
+        error.clear();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno != ENOENT) error = path + ": " + std::strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(JournalHeader)) {
+            ::close(fd);
+            error = path + ": not a journal";
+            return false;
+        }
+        void* m = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            error = path + ": " + std::strerror(errno);
+            return false;
+        }
+        madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+        map_ = (const char*)m;
+        bytes_ = (size_t)st.st_size;
+#else
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (!f) {
+            if (errno != ENOENT) error = path + ": " + std::strerror(errno);
+            return false;
+        }
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = std::fread(chunk, 1, sizeof(chunk), f)) > 0) data_.append(chunk, n);
+        std::fclose(f);
+        if (data_.size() < sizeof(JournalHeader)) {
+            error = path + ": not a journal";
+            return false;
+        }
+        map_ = data_.data();
+        bytes_ = data_.size();
+#endif
+        std::memcpy(&header_, map_, sizeof(header_));
+        if (std::memcmp(header_.magic, kJournalMagic, sizeof(kJournalMagic)) != 0 ||
+            header_.version != 1 || header_.recordSize != sizeof(JournalRecord)) {
+            error = path + ": not a version 1 journal";
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (map_) munmap((void*)map_, bytes_);
+#else
+        data_.clear();
+#endif
+        map_ = nullptr;
+        bytes_ = 0;
+    }
+
+    const JournalHeader& header() const { return header_; }
+    size_t bytes() const { return bytes_; }
+
+    const JournalRecord* records() const {
+        return (const JournalRecord*)(map_ + sizeof(JournalHeader));
+    }
+    size_t record_count() const {
+        return (bytes_ - sizeof(JournalHeader)) / sizeof(JournalRecord);
+    }
+
+private:
+    const char* map_ = nullptr;
+    size_t bytes_ = 0;
+    JournalHeader header_{};
+#ifdef _WIN32
+    std::string data_;
+#endif
+};
+
+// Applies one journal record to the stats it came from: the same updates,
+// in the same order, that floor_arrival and update_elevator make, so the
+// sums come out bit-identical. False for a record that does not fit the
+// building.
+bool replay_record(StatsSnapshot& snap, const JournalRecord& r) {
+    if (r.kind != (std::uint8_t)JournalKind::Spawn && r.car >= snap.cars.size()) return false;
+    int h = sim_hour(TimePoint{} + SimClock::duration(r.timeNs));
+    switch ((JournalKind)r.kind) {
+    case JournalKind::Spawn:
+        snap.stats.totalPassengers++;
+        return true;
+    case JournalKind::Board: {
+        ElevatorStats& es = snap.cars[r.car];
+        snap.stats.totalWaitSec += r.value;
+        snap.stats.waitSec.add(r.value);
+        es.waitSec.add(r.value);
+        snap.hourly[h].totalWaitSec += r.value;
+        snap.hourly[h].waitCount++;
+        snap.hourly[h].waitSec.add(r.value);
+        return true;
+    }
+    case JournalKind::Alight:
+        snap.stats.completedPassengers++;
+        snap.cars[r.car].passengersMoved++;
+        return true;
+    case JournalKind::Depart: {
+        ElevatorStats& es = snap.cars[r.car];
+        snap.stats.totalTrips++;
+        snap.stats.completedTrips++;
+        snap.stats.totalTripSec += r.value;
+        snap.stats.tripSec.add(r.value);
+        es.trips++;
+        es.tripSec.add(r.value);
+        snap.hourly[h].trips++;
+        return true;
+    }
+    case JournalKind::Arrive: {
+        ElevatorStats& es = snap.cars[r.car];
+        snap.stats.totalEnergyKWh += r.value;
+        es.energyKWh += r.value;
+        snap.hourly[h].energyKWh += r.value;
+        es.stopCount++;
+        es.doorOpenCount++;
+        return true;
+    }
+    }
+    return false;
+}
+
+// --replay: streams a journal (PATH, or PATH.000000, PATH.000001, ... when
+// it was rotated) and prints the /stats/daily JSON of the recorded run,
+// without simulating anything.
+int replay_journal(const std::string& path) {
+    auto wallStart = WallClock::now();
+    StatsSnapshot snap;
+    JournalHeader first{};
+    unsigned long long records = 0, bytes = 0;
+    std::string error;
+
+    // a rotated journal has no file at PATH itself
+    std::FILE* probe = std::fopen(path.c_str(), "rb");
+    bool rotated = !probe;
+    if (probe) std::fclose(probe);
+
+    for (unsigned segment = 0;; ++segment) {
+        std::string file = rotated ? journal_segment_path(path, segment) : path;
+        JournalFile jf;
+        if (!jf.open(file, error)) {
+            if (error.empty() && segment > 0) break; // past the last segment
+            if (error.empty()) error = path + ": no such journal";
+            std::cerr << "replay: " << error << "\n";
+            return 1;
+        }
+
+        const JournalHeader& h = jf.header();
+        if (segment == 0 && h.segment == 0) {
+            if (h.floors < 2 || h.cars < 1 || h.cars > kJournalNoCar) {
+                std::cerr << "replay: " << file << ": bad building in header\n";
+                return 1;
+            }
+            first = h;
+            snap.floors = h.floors;
+            for (int c = 0; c < h.cars; ++c) snap.ids.push_back(c + 1);
+            snap.cars.resize(h.cars);
+        } else if (h.segment != segment || h.floors != first.floors || h.cars != first.cars ||
+                   h.seed != first.seed) {
+            std::cerr << "replay: " << file << " is not segment " << segment
+                      << " of the same journal\n";
+            return 1;
+        }
+
+        const JournalRecord* r = jf.records();
+        const JournalRecord* end = r + jf.record_count();
+        bool ended = false;
+        for (; r != end; ++r) {
+            if (r->kind == 0) { ended = true; break; } // unused tail of a mapped segment
+            if (!replay_record(snap, *r)) {
+                std::cerr << "replay: " << file << ": bad record " << (r - jf.records()) << "\n";
+                return 1;
+            }
+        }
+        records += (unsigned long long)(r - jf.records());
+        bytes += jf.bytes();
+        if (!rotated || ended) break; // a cut-short segment was the last one written
+    }
+    double wallSec = std::chrono::duration<double>(WallClock::now() - wallStart).count();
+
+    std::cout << stats_json(snap) << "\n";
+    char dispatcher[sizeof(first.dispatcher) + 1] = {};
+    std::memcpy(dispatcher, first.dispatcher, sizeof(first.dispatcher));
+    std::cerr << "journal: " << first.floors << " floors, " << first.cars << " cars of "
+              << first.capacity << ", dispatch " << dispatcher << ", seed " << first.seed << "\n"
+              << "replayed " << records << " records (" << bytes / 1e6 << " MB) in " << wallSec
+              << " s (" << (wallSec > 0 ? records / wallSec : 0.0) << " records/s, "
+              << (wallSec > 0 ? bytes / 1e6 / wallSec : 0.0) << " MB/s)\n";
+    return 0;
+}
+
+// Sample mean and 95% confidence half-width (Student t).
+struct Estimate {
+    double mean = 0.0;
+    double ci95 = 0.0;
+};
+
+Estimate estimate(const std::vector<double>& xs) {
+    static const double t975[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+
+    Estimate est;
+    size_t n = xs.size();
+    if (n == 0) return est;
+    for (double x : xs) est.mean += x;
+    est.mean /= n;
+    if (n < 2) return est;
+
+    double ss = 0.0;
+    for (double x : xs) ss += (x - est.mean) * (x - est.mean);
+    double sd = std::sqrt(ss / (n - 1));
+    double t = (n - 1 <= 30) ? t975[n - 2] : 1.96;
+    est.ci95 = t * sd / std::sqrt((double)n);
+    return est;
+}
+
+// Monte Carlo: `reps` independent batch runs spread over `threads` workers.
+// Replication r always uses RNG stream r of `seed`, whichever thread runs it.
+int run_replications(const BuildingParams& bp, int days, int reps, int threads,
+                     unsigned long long seed) {
+    std::vector<double> wait(reps), trip(reps), energy(reps);
+    std::vector<unsigned long long> eventCounts(reps);
+    std::vector<QuantileSketch> waitSketch(reps), tripSketch(reps);
+    std::atomic<int> nextRep{ 0 };
+
+    auto worker = [&]() {
+        Simulation sim;
+        for (int r = nextRep++; r < reps; r = nextRep++) {
+            init_building(sim, bp, seed, (unsigned)r);
+            run_days(sim, days);
+            wait[r] = avg_wait_sec(sim.stats);
+            trip[r] = avg_trip_sec(sim.stats);
+            energy[r] = sim.stats.totalEnergyKWh;
+            waitSketch[r] = sim.stats.waitSec;
+            tripSketch[r] = sim.stats.tripSec;
+            eventCounts[r] = sim.eventCount;
+        }
+    };
+
+    auto wallStart = WallClock::now();
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+    for (auto& th : pool) th.join();
+    double wallSec = std::chrono::duration<double>(WallClock::now() - wallStart).count();
+
+    unsigned long long events = 0;
+    for (auto n : eventCounts) events += n;
+    // every passenger of every replication, for pooled percentiles
+    QuantileSketch allWaits, allTrips;
+    for (int r = 0; r < reps; ++r) {
+        allWaits.merge(waitSketch[r]);
+        allTrips.merge(tripSketch[r]);
+    }
+
+    auto field = [](std::ostringstream& out, const char* name, const Estimate& e) {
+        out << "\"" << name << "\":{\"mean\":" << e.mean << ",\"ci95\":" << e.ci95 << "}";
+    };
+    auto quantiles = [](std::ostringstream& out, const char* name, const QuantileSketch& q) {
+        out << "\"" << name << "\":{\"p50\":" << q.quantile(0.50) << ",\"p95\":"
+            << q.quantile(0.95) << ",\"p99\":" << q.quantile(0.99) << "}";
+    };
+
+    std::ostringstream out;
+    out << "{";
+    out << "\"floorCount\":" << bp.floors << ",";
+    out << "\"cars\":" << bp.cars << ",";
+    out << "\"dispatcher\":\"" << bp.dispatcher << "\",";
+    out << "\"days\":" << days << ",";
+    out << "\"replications\":" << reps << ",";
+    field(out, "avgWaitSec", estimate(wait));
+    out << ",";
+    quantiles(out, "waitSec", allWaits);
+    out << ",";
+    field(out, "avgTripSec", estimate(trip));
+    out << ",";
+    quantiles(out, "tripSec", allTrips);
+    out << ",";
+    field(out, "energyKWh", estimate(energy));
+    out << "}";
+
+    std::cout << out.str() << "\n";
+    std::cerr << reps << " replication(s) of " << days << " day(s) on " << threads
+              << " thread(s): " << events << " events in " << wallSec << " s ("
+              << (wallSec > 0 ? events / wallSec : 0.0) << " events/s)\n";
+    return 0;
+}
+
+// Average wall nanoseconds per call of fn() over `iters` calls.
+template <class F>
+double ns_per_call(F&& fn, long iters) {
+    auto t0 = WallClock::now();
+    for (long i = 0; i < iters; ++i) fn();
+    return std::chrono::duration<double, std::nano>(WallClock::now() - t0).count() / iters;
+}
+
+volatile long long gBenchSink; // keeps benchmark results observable
+
+#ifdef SIM_BENCH_ALLOC
+// Heap allocations made by the current thread, for --bench json; only in
+// builds with -DSIM_BENCH_ALLOC, as it replaces operator new for every
+// thread. The replacements stay out of line, like the library's own, so
+// GCC does not mistake the inlined free() for a mismatched delete.
+thread_local unsigned long long tAllocations = 0;
+
+#ifdef __GNUC__
+#define SIM_NOINLINE __attribute__((noinline))
+#else
+#define SIM_NOINLINE
+#endif
+
+SIM_NOINLINE void* operator new(std::size_t size) {
+    ++tAllocations;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+SIM_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+SIM_NOINLINE void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Heap allocations per call of fn() over `iters` calls.
+template <class F>
+double allocs_per_call(F&& fn, long iters) {
+    unsigned long long before = tAllocations;
+    for (long i = 0; i < iters; ++i) fn();
+    return (double)(tAllocations - before) / iters;
+}
+#else
+// Not counted in this build: negative.
+template <class F>
+double allocs_per_call(F&&, long) { return -1.0; }
+#endif
+
+// The whole simulation over `days`, event by event, with the cars stored
+// two ways: Fleet, as the simulation runs them, and the array-of-structs
+// Elevator the fleet was before Fleet (ElevatorStats inline). The AoS
+// engine is update_elevator and run_due_events with e.field for
+// f.field[c], down to the virtual dispatch call and the journal checks;
+// both run the same seeded traffic and must end with the same stats.
+int bench_fleet(BuildingParams bp, int days, unsigned long long seed) {
+    struct ElevatorAoS {
+        int id;
+        int currentFloor;
+        int targetFloor;
+        int direction;
+        ElevatorState state;
+        TimePoint stateEndTime;
+        int capacity;
+        std::vector<Passenger> onboard;
+        ElevatorStats stats;
+        unsigned long long version = 0;
+    };
+    struct DispatcherAoS {
+        virtual ~DispatcherAoS() = default;
+        virtual int next_target(const Simulation& sim, const ElevatorAoS& e) = 0;
+    };
+    struct NearestCallAoS : DispatcherAoS {
+        int next_target(const Simulation& sim, const ElevatorAoS& e) override {
+            if (!e.onboard.empty()) return e.onboard.front().destFloor;
+            int best = sim.calls.nearest(e.currentFloor);
+            return best < 0 ? e.currentFloor : best;
+        }
+    };
+    std::unique_ptr<DispatcherAoS> dispatcher(new NearestCallAoS);
+
+    auto update = [&](Simulation& sim, int c, ElevatorAoS& e, TimePoint now) -> unsigned {
+        using namespace std::chrono;
+        if (now < e.stateEndTime) return kChangedNothing;
+        if (e.state == ElevatorState::Idle) {
+            int next = dispatcher->next_target(sim, e);
+            if (next == e.currentFloor) {
+                e.direction = 0;
+                e.stateEndTime = now + seconds(1);
+                return kChangedNothing;
+            }
+            e.targetFloor = next;
+            int diff = e.targetFloor - e.currentFloor;
+            e.direction = diff > 0 ? +1 : -1;
+            e.state = ElevatorState::Moving;
+            double tSec = travel_time_sec(std::abs(diff));
+            e.stateEndTime = now + duration_cast<SimClock::duration>(duration<double>(tSec));
+            sim.stats.totalTrips++;
+            sim.stats.completedTrips++;
+            sim.stats.totalTripSec += tSec;
+            sim.stats.tripSec.add(tSec);
+            e.stats.trips++;
+            e.stats.tripSec.add(tSec);
+            if (sim.journal)
+                sim.journal->append(now, JournalKind::Depart, c, e.currentFloor, next, tSec);
+            sim.hourly[sim_hour(now)].trips++;
+            return kChangedState | kChangedStats;
+        }
+        if (e.state == ElevatorState::Moving) {
+            int diff = std::abs(e.targetFloor - e.currentFloor);
+            double energy = 0.05 * diff * (1.0 + 0.05 * e.onboard.size());
+            sim.stats.totalEnergyKWh += energy;
+            e.stats.energyKWh += energy;
+            sim.hourly[sim_hour(now)].energyKWh += energy;
+
+            int floor = e.targetFloor;
+            if (sim.journal)
+                sim.journal->append(now, JournalKind::Arrive, c, floor, (int)e.onboard.size(),
+                                    energy);
+            e.currentFloor = floor;
+            e.direction = 0;
+            e.state = ElevatorState::DoorOpen;
+            e.stateEndTime = now + seconds(5);
+            e.stats.stopCount++;
+            e.stats.doorOpenCount++;
+
+            auto it = e.onboard.begin();
+            while (it != e.onboard.end()) {
+                if (it->destFloor == floor) {
+                    sim.stats.completedPassengers++;
+                    e.stats.passengersMoved++;
+                    if (sim.journal)
+                        sim.journal->append(now, JournalKind::Alight, c, floor, it->startFloor,
+                                            duration<double>(now - it->created).count());
+                    it = e.onboard.erase(it);
+                } else ++it;
+            }
+
+            int capLeft = e.capacity - (int)e.onboard.size();
+            auto board = [&](std::deque<Passenger>& q) {
+                while (capLeft > 0 && !q.empty()) {
+                    Passenger p = q.front(); q.pop_front();
+                    double waitSec = duration<double>(now - p.created).count();
+                    sim.stats.totalWaitSec += waitSec;
+                    sim.stats.waitSec.add(waitSec);
+                    e.stats.waitSec.add(waitSec);
+                    int h = sim_hour(now);
+                    sim.hourly[h].totalWaitSec += waitSec;
+                    sim.hourly[h].waitCount++;
+                    sim.hourly[h].waitSec.add(waitSec);
+                    if (sim.journal)
+                        sim.journal->append(now, JournalKind::Board, c, floor, p.destFloor, waitSec);
+                    e.onboard.push_back(p);
+                    capLeft--;
+                }
+            };
+            board(sim.upQ[floor]);
+            board(sim.downQ[floor]);
+            if (sim.upQ[floor].empty()) HallCalls::set(sim.calls.up, floor, false);
+            if (sim.downQ[floor].empty()) HallCalls::set(sim.calls.down, floor, false);
+            return kChangedState | kChangedStats;
+        }
+        e.state = ElevatorState::Idle;
+        e.stateEndTime = now + seconds(1);
+        return kChangedState;
+    };
+
+    auto runDueAoS = [&](Simulation& sim, std::vector<ElevatorAoS>& cars, TimePoint now) {
+        while (!sim.events.empty() && sim.events.top().at <= now) {
+            SimEvent ev = sim.events.top();
+            sim.events.pop();
+            sim.eventCount++;
+            sim.now = ev.at;
+
+            unsigned changed;
+            if (ev.kind == EventKind::Arrival) {
+                changed = floor_arrival(sim, ev.index, ev.at);
+                schedule(sim, next_arrival_candidate(sim, ev.at), EventKind::Arrival, ev.index);
+            } else {
+                changed = update(sim, ev.index, cars[ev.index], ev.at);
+                schedule(sim, cars[ev.index].stateEndTime, EventKind::Elevator, ev.index);
+            }
+            if (changed & kChangedState) {
+                sim.stateVersion++;
+                sim.stateChangedAt = ev.at;
+                cars[ev.index].version = sim.stateVersion;
+            }
+            if (changed & kChangedStats) sim.statsVersion++;
+        }
+    };
+
+    bp.dispatcher = "nearest";
+    bp.capacities.clear();
+    bp.startFloors.clear();
+    const TimePoint end = TimePoint{} + std::chrono::seconds(1LL * days * 24 * kSimSecondsPerHour);
+    std::printf("%d floors, %d day(s), nearest dispatcher; a tick is one wake of the simulation"
+                " thread\n", bp.floors, days);
+    std::printf("cars   ticks      events   AoS ns/tick   SoA ns/tick   AoS/SoA\n");
+    for (int n : { 3, 64, 1024 }) {
+        bp.cars = n;
+        Simulation soa, aos;
+        std::vector<ElevatorAoS> cars;
+        long ticks = 0, runs = 0;
+        double soaNs = 0, aosNs = 0;
+        // whole runs until each layout has had 200 ms, so small fleets are not noise
+        while (soaNs < 2e8 || aosNs < 2e8) {
+            init_building(soa, bp, seed, 0);
+            init_building(aos, bp, seed, 0);
+            cars.assign(n, ElevatorAoS{});
+            for (int c = 0; c < n; ++c) {
+                cars[c].id = aos.fleet.id[c];
+                cars[c].currentFloor = cars[c].targetFloor = aos.fleet.currentFloor[c];
+                cars[c].direction = 0;
+                cars[c].state = aos.fleet.state[c];
+                cars[c].stateEndTime = aos.fleet.stateEndTime[c];
+                cars[c].capacity = aos.fleet.capacity[c];
+            }
+            aos.fleet = Fleet{};
+
+            auto t0 = WallClock::now();
+            while (soa.events.top().at < end) {
+                run_due_events(soa, soa.events.top().at);
+                ++ticks;
+            }
+            soaNs += std::chrono::duration<double, std::nano>(WallClock::now() - t0).count();
+            t0 = WallClock::now();
+            while (aos.events.top().at < end) runDueAoS(aos, cars, aos.events.top().at);
+            aosNs += std::chrono::duration<double, std::nano>(WallClock::now() - t0).count();
+            ++runs;
+        }
+
+        if (aos.eventCount != soa.eventCount ||
+            aos.stats.completedPassengers != soa.stats.completedPassengers ||
+            aos.stats.totalWaitSec != soa.stats.totalWaitSec ||
+            aos.stats.totalEnergyKWh != soa.stats.totalEnergyKWh) {
+            std::cerr << "AoS and SoA runs disagree at " << n << " cars\n";
+            return 1;
+        }
+        std::printf("%4d %7ld %11llu   %11.1f   %11.1f   %6.2fx\n", n, ticks / runs, soa.eventCount,
+                    aosNs / ticks, soaNs / ticks, aosNs / soaNs);
+    }
+    return 0;
+}
+
+// Nearest-call lookup: the old walk over every floor's queues against the
+// HallCalls bitset search, with about one waiting floor in twenty.
+int bench_calls() {
+    std::mt19937 gen(1);
+    std::cout << "floors   scan ns/lookup   bitset ns/lookup   speedup\n";
+    for (int floors : { 5, 100, 500 }) {
+        std::vector<std::deque<Passenger>> upQ(floors + 1), downQ(floors + 1);
+        HallCalls calls;
+        calls.reset(floors);
+
+        std::uniform_int_distribution<int> floorDist(1, floors);
+        for (int k = 0; k < std::max(1, floors / 20); ++k) {
+            int fl = floorDist(gen);
+            upQ[fl].push_back(Passenger{});
+            HallCalls::set(calls.up, fl, true);
+        }
+
+        std::vector<int> from(64);
+        for (int& fl : from) fl = floorDist(gen);
+
+        size_t q = 0;
+        auto scan = [&]() {
+            int cur = from[q++ % from.size()];
+            int best = cur, bestDist = std::numeric_limits<int>::max();
+            for (int fl = 1; fl <= floors; ++fl) {
+                if (upQ[fl].empty() && downQ[fl].empty()) continue;
+                int d = std::abs(fl - cur);
+                if (d < bestDist) { bestDist = d; best = fl; }
+            }
+            gBenchSink = best;
+        };
+        auto bitset = [&]() {
+            int cur = from[q++ % from.size()];
+            int best = calls.nearest(cur);
+            gBenchSink = best < 0 ? cur : best;
+        };
+
+        for (size_t i = 0; i < from.size(); ++i) {
+            scan();
+            long long a = gBenchSink;
+            --q;
+            bitset();
+            if (gBenchSink != a) {
+                std::cerr << "bitset lookup disagrees with scan at " << floors << " floors\n";
+                return 1;
+            }
+        }
+
+        long iters = 20000000L / floors;
+        double a = ns_per_call(scan, iters);
+        double b = ns_per_call(bitset, iters);
+        std::printf("%6d   %14.1f   %16.1f   %6.1fx\n", floors, a, b, a / b);
+    }
+    return 0;
+}
+
+// Every registered dispatcher on the same seeded building and traffic:
+// wall time per decision (including ~20 ns of clock reads) and the service
+// it produced.
+int bench_dispatch(BuildingParams bp, int days, unsigned long long seed) {
+    class TimedDispatcher : public Dispatcher {
+    public:
+        explicit TimedDispatcher(std::unique_ptr<Dispatcher> inner) : inner_(std::move(inner)) {}
+
+        int next_target(const Simulation& sim, int c, TimePoint now) override {
+            auto t0 = WallClock::now();
+            int target = inner_->next_target(sim, c, now);
+            elapsed_ += WallClock::now() - t0;
+            ++calls_;
+            return target;
+        }
+
+        double ns_per_call() const {
+            return calls_ ? std::chrono::duration<double, std::nano>(elapsed_).count() / calls_ : 0.0;
+        }
+        long long calls() const { return calls_; }
+
+    private:
+        std::unique_ptr<Dispatcher> inner_;
+        WallClock::duration elapsed_{};
+        long long calls_ = 0;
+    };
+
+    std::printf("%d floors, %d cars, %d day(s)\n", bp.floors, bp.cars, days);
+    std::cout << "dispatcher   decisions   ns/decision   avgWaitSec   avgTripSec\n";
+    for (const auto& entry : dispatcher_registry()) {
+        bp.dispatcher = entry.name;
+        Simulation sim;
+        init_building(sim, bp, seed, 0);
+        auto timed = new TimedDispatcher(std::move(sim.dispatcher));
+        sim.dispatcher.reset(timed);
+
+        run_days(sim, days);
+        std::printf("%-10s   %9lld   %11.1f   %10.2f   %10.2f\n", entry.name, timed->calls(),
+                    timed->ns_per_call(), avg_wait_sec(sim.stats), avg_trip_sec(sim.stats));
+    }
+    return 0;
+}
+
+// Replaces whichever gSim snapshot is behind its version and, if anyone
+// is subscribed, pushes the cars that changed to /state/stream and
+// /state/ws. The stats snapshot carries every quantile sketch, so it is
+// only replaced when `withStats` is set. Caller holds gMutex.
+void publish_snapshots(const Simulation& sim, bool withStats = true) {
+    auto fleet = std::atomic_load(&gFleetSnapshot);
+    if (!fleet || fleet->version != sim.stateVersion) {
+        // log first, so a reader never sees a snapshot the log lags behind
+        std::vector<char> changed(sim.fleet.size(), 0);
+        if (fleet)
+            for (int c = 0; c < sim.fleet.size(); ++c)
+                if (sim.fleet.version[c] > fleet->version) {
+                    gStateLog.record(sim.fleet.version[c], c);
+                    changed[c] = 1;
+                }
+        auto next = take_fleet_snapshot(sim);
+        std::atomic_store(&gFleetSnapshot, next);
+
+        // after the store, so a subscriber's resync never misses this one
+        if (fleet && gStreamHub.has_subscribers())
+            gStreamHub.publish(std::make_shared<const std::string>(sse_message(
+                "transition", state_delta_json(*next, state_version_token(next->version), &changed))));
+        if (fleet && gSocketHub.has_subscribers())
+            gSocketHub.publish(std::make_shared<const std::string>(
+                ws_frame(kWsBinary, binary_state(*next, &changed))));
+    }
+    if (!withStats) return;
+    auto stats = std::atomic_load(&gStatsSnapshot);
+    if (!stats || stats->version != sim.statsVersion)
+        std::atomic_store(&gStatsSnapshot, take_stats_snapshot(sim));
+}
+
+// Copying the sketches costs more than a fast-forwarded tick, so /stats
+// follows the simulation at most this often, plus whenever it sleeps.
+const int kStatsPublishMs = 50;
+
+// Sleeps (in paced mode) until the next scheduled event instead of polling
+// every car.
+void sim_loop() {
+    auto lastStats = WallClock::now();
+    while (true) {
+        TimePoint next;
+        {
+            TimedLock lock(gMutex);
+            next = gSim.events.top().at;
+        }
+        TimePoint now = gPacer.sleep_until(next);
+
+        TimedLock lock(gMutex);
+        run_due_events(gSim, now);
+        bool sleepsNext = !gPacer.unpaced() && gSim.events.top().at > gPacer.now();
+        bool withStats = sleepsNext ||
+                         lock.acquired() - lastStats >= std::chrono::milliseconds(kStatsPublishMs);
+        if (withStats) lastStats = lock.acquired();
+        publish_snapshots(gSim, withStats);
+        if (withStats && gSim.journal) gSim.journal->flush(); // same cadence
+        gMetrics.tick(WallClock::now() - lock.acquired());
+    }
+}
+
+// Serializing /state and /stats/daily the way it was done before
+// JsonWriter (ostringstream, a std::string per state name, the body copied
+// in behind the head) against JsonWriter and OutBuffer, on a building run
+// for `days` days.
+int bench_json(const BuildingParams& bp, int days, unsigned long long seed) {
+    Simulation sim;
+    init_building(sim, bp, seed, 0);
+    run_days(sim, days);
+    auto fleet = take_fleet_snapshot(sim);
+    auto stats = take_stats_snapshot(sim);
+
+    auto streamCar = [](std::ostream& out, const CarSnapshot& e, TimePoint at) {
+        long long remainingMs =
+            std::chrono::duration_cast<std::chrono::milliseconds>(e.stateEndTime - at).count();
+        if (remainingMs < 0) remainingMs = 0;
+        std::string stateStr;
+        switch (e.state) {
+            case ElevatorState::Idle:     stateStr = "Idle"; break;
+            case ElevatorState::Moving:   stateStr = "Moving"; break;
+            case ElevatorState::DoorOpen: stateStr = "DoorOpen"; break;
+        }
+        out << "{" << "\"id\":" << e.id << ",\"currentFloor\":" << e.currentFloor
+            << ",\"targetFloor\":" << e.targetFloor << ",\"direction\":" << e.direction
+            << ",\"doorOpen\":" << (e.state == ElevatorState::DoorOpen ? "true" : "false")
+            << ",\"load\":" << e.load << ",\"capacity\":" << e.capacity
+            << ",\"state\":\"" << stateStr << "\"" << ",\"remainingMs\":" << remainingMs << "}";
+    };
+    auto streamState = [&](const FleetSnapshot& snap) {
+        std::ostringstream out;
+        out << "{" << "\"floorCount\":" << snap.floors << ","
+            << "\"asOfMs\":" << as_of_ms(snap) << "," << "\"elevators\":[";
+        for (size_t i = 0; i < snap.cars.size(); ++i) {
+            if (i) out << ",";
+            streamCar(out, snap.cars[i], snap.at);
+        }
+        out << "]}";
+        return out.str();
+    };
+    auto streamQuantiles = [](std::ostream& out, const QuantileSketch& q) {
+        out << "{" << "\"p50\":" << q.quantile(0.50) << ",\"p95\":" << q.quantile(0.95)
+            << ",\"p99\":" << q.quantile(0.99) << "}";
+    };
+    auto streamStats = [&](const StatsSnapshot& snap) {
+        int peakHour = 0, maxTrips = 0;
+        for (int h = 0; h < 24; ++h)
+            if (snap.hourly[h].trips > maxTrips) { maxTrips = snap.hourly[h].trips; peakHour = h; }
+        std::ostringstream out;
+        out << "{" << "\"floorCount\":" << snap.floors << ","
+            << "\"totalTrips\":" << snap.stats.totalTrips << ","
+            << "\"totalPassengers\":" << snap.stats.totalPassengers << ","
+            << "\"avgWaitSec\":" << avg_wait_sec(snap.stats) << ","
+            << "\"waitSec\":";
+        streamQuantiles(out, snap.stats.waitSec);
+        out << "," << "\"avgTripSec\":" << avg_trip_sec(snap.stats) << ","
+            << "\"tripSec\":";
+        streamQuantiles(out, snap.stats.tripSec);
+        out << "," << "\"avgEnergyKWh\":" << avg_energy_kwh(snap.stats) << ","
+            << "\"peakHour\":" << peakHour << "," << "\"elevators\":[";
+        for (size_t i = 0; i < snap.cars.size(); ++i) {
+            const ElevatorStats& e = snap.cars[i];
+            if (i) out << ",";
+            out << "{" << "\"id\":" << snap.ids[i] << ",\"trips\":" << e.trips
+                << ",\"passengersMoved\":" << e.passengersMoved << ",\"energyKWh\":" << e.energyKWh
+                << ",\"doorOpenCount\":" << e.doorOpenCount << ",\"stopCount\":" << e.stopCount
+                << ",\"waitSec\":";
+            streamQuantiles(out, e.waitSec);
+            out << ",\"tripSec\":";
+            streamQuantiles(out, e.tripSec);
+            out << "}";
+        }
+        out << "]," << "\"hourly\":[";
+        for (int h = 0; h < 24; ++h) {
+            if (h) out << ",";
+            double hAvgWait = snap.hourly[h].waitCount > 0
+                                  ? snap.hourly[h].totalWaitSec / snap.hourly[h].waitCount : 0.0;
+            out << "{" << "\"hour\":" << h << ",\"trips\":" << snap.hourly[h].trips
+                << ",\"avgWaitSec\":" << hAvgWait << ",\"waitSec\":";
+            streamQuantiles(out, snap.hourly[h].waitSec);
+            out << ",\"energyKWh\":" << snap.hourly[h].energyKWh << "}";
+        }
+        out << "]}";
+        return out.str();
+    };
+    auto streamResponse = [](const std::string& body) {
+        std::ostringstream out;
+        out << "HTTP/1.1 200 OK\r\n" << "Content-Type: application/json\r\n"
+            << "Content-Length: " << body.size() << "\r\n" << "Connection: keep-alive\r\n\r\n"
+            << body;
+        return out.str();
+    };
+
+    JsonWriter w;
+    OutBuffer out;
+    state_json(w, *fleet);
+    const std::string stateBody = w.str();
+    if (streamState(*fleet) != stateBody) {
+        std::cerr << "JsonWriter /state output differs from ostringstream\n";
+        return 1;
+    }
+    w.clear();
+    stats_json(w, *stats);
+    if (streamStats(*stats) != w.str()) {
+        std::cerr << "JsonWriter /stats/daily output differs from ostringstream\n";
+        return 1;
+    }
+    auto cachedBody = std::make_shared<const std::string>(stateBody);
+    const size_t responseBytes = streamResponse(stateBody).size();
+
+    struct Case {
+        const char* name;
+        size_t bytes;
+        std::function<void()> run;
+    };
+    std::vector<Case> cases = {
+        { "/state body, ostringstream", stateBody.size(),
+          [&] { gBenchSink = (long long)streamState(*fleet).size(); } },
+        { "/state body, JsonWriter", stateBody.size(),
+          [&] { w.clear(); state_json(w, *fleet); gBenchSink = (long long)w.str().size(); } },
+        { "/stats body, ostringstream", w.str().size(),
+          [&] { gBenchSink = (long long)streamStats(*stats).size(); } },
+        { "/stats body, JsonWriter", w.str().size(),
+          [&] { w.clear(); stats_json(w, *stats); gBenchSink = (long long)w.str().size(); } },
+        { "cached /state response, copy", responseBytes,
+          [&] { gBenchSink = (long long)streamResponse(*cachedBody).size(); } },
+        { "cached /state response, OutBuffer", responseBytes,
+          [&] {
+              out.clear();
+              http_ok(out, cachedBody, true);
+              gBenchSink = (long long)out.size();
+          } },
+    };
+
+    std::printf("%d floors, %d cars, %d day(s)\n", bp.floors, bp.cars, days);
+    std::printf("%-34s %7s %9s %9s %10s\n", "case", "bytes", "ns/op", "MB/s", "allocs/op");
+    for (Case& c : cases) {
+        long iters = std::max(2000L, 200000000L / (long)(c.bytes * 20));
+        c.run(); // warm up writer and buffer capacity
+        double allocs = allocs_per_call(c.run, 1000);
+        double ns = ns_per_call(c.run, iters);
+        if (allocs < 0)
+            std::printf("%-34s %7zu %9.1f %9.1f %10s\n", c.name, c.bytes, ns,
+                        c.bytes / ns * 1e3, "-");
+        else
+            std::printf("%-34s %7zu %9.1f %9.1f %10.2f\n", c.name, c.bytes, ns,
+                        c.bytes / ns * 1e3, allocs);
+    }
+    if (allocs_per_call([] {}, 1) < 0)
+        std::printf("(allocs/op: build with -DSIM_BENCH_ALLOC)\n");
+    return 0;
+}
+
+// How tick cost and /state latency grow with the building: every pair of
+// floor and car counts on the same seeded traffic, warmed up for `days`
+// days, then one more simulated day run wake by wake as sim_loop runs it
+// (the events due at one time, plus the fleet snapshot when /state
+// changed). /state is what the first request after a tick costs: the
+// snapshot, its JSON and the response around it.
+int bench_scale(BuildingParams bp, int days, unsigned long long seed) {
+    std::printf("%s dispatcher, %d day(s) warm-up\n", bp.dispatcher.c_str(), days);
+    std::printf("%6s %5s %10s %9s %9s %9s %9s %10s %10s\n", "floors", "cars", "events/s",
+                "tick p50", "tick p99", "tick max", "/state", "/state KB", "/stats");
+    JsonWriter w;
+    OutBuffer out;
+    for (int floors : { 5, 50, 300 }) {
+        for (int cars : { 3, 16, 128 }) {
+            bp.floors = floors;
+            bp.cars = cars;
+            bp.capacities.clear();
+            bp.startFloors.clear();
+            Simulation sim;
+            init_building(sim, bp, seed, 0);
+            auto t0 = WallClock::now();
+            run_days(sim, days);
+            double eventsPerSec =
+                sim.eventCount / std::chrono::duration<double>(WallClock::now() - t0).count();
+
+            TimePoint end = TimePoint{} + std::chrono::seconds(1LL * (days + 1) * 24 * kSimSecondsPerHour);
+            std::vector<double> tickUs;
+            while (sim.events.top().at < end) {
+                auto started = WallClock::now();
+                unsigned long long version = sim.stateVersion;
+                run_due_events(sim, sim.events.top().at);
+                if (sim.stateVersion != version)
+                    gBenchSink = (long long)take_fleet_snapshot(sim)->cars.size();
+                tickUs.push_back(
+                    std::chrono::duration<double, std::micro>(WallClock::now() - started).count());
+            }
+            auto pct = [&](double q) {
+                size_t k = std::min(tickUs.size() - 1, (size_t)(q * tickUs.size()));
+                std::nth_element(tickUs.begin(), tickUs.begin() + k, tickUs.end());
+                return tickUs[k];
+            };
+            double p50 = pct(0.50), p99 = pct(0.99);
+            double tickMax = *std::max_element(tickUs.begin(), tickUs.end());
+
+            auto state = [&] {
+                auto snap = take_fleet_snapshot(sim);
+                w.clear();
+                state_json(w, *snap);
+                out.clear();
+                http_ok(out, w.str(), true);
+                gBenchSink = (long long)out.size();
+            };
+            auto stats = [&] {
+                auto snap = take_stats_snapshot(sim);
+                w.clear();
+                stats_json(w, *snap);
+                gBenchSink = (long long)w.str().size();
+            };
+            state();
+            double stateKB = w.str().size() / 1024.0;
+            long iters = std::max(200L, 20000000L / (long)w.str().size());
+            double stateUs = ns_per_call(state, iters) / 1e3;
+            double statsUs = ns_per_call(stats, 2000) / 1e3;
+            std::printf("%6d %5d %10.3g %7.2fus %7.2fus %7.1fus %7.2fus %10.1f %8.1fus\n", floors,
+                        cars, eventsPerSec, p50, p99, tickMax, stateUs, stateKB, statsUs);
+        }
+    }
+    return 0;
+}
+
+// QuantileSketch against what GlobalStats kept before (a sum and a count)
+// and against keeping every value for exact percentiles: update and query
+// cost, memory and the error of p50/p95/p99. The values are lognormal
+// waits with a 20 s median, close to what a busy day produces.
+int bench_sketch(unsigned long long seed) {
+    const size_t n = 1 << 20;
+    std::mt19937 gen((unsigned)seed);
+    std::lognormal_distribution<double> waits(std::log(20.0), 0.8);
+    std::vector<double> values(n);
+    for (double& v : values) v = waits(gen);
+
+    size_t i = 0;
+    double total = 0.0;
+    long long count = 0;
+    QuantileSketch sketch;
+    std::vector<double> exact;
+    exact.reserve(n);
+
+    auto sumOnly = [&] { total += values[i++ & (n - 1)]; count++; gBenchSink = count; };
+    auto addSketch = [&] {
+        sketch.add(values[i++ & (n - 1)]);
+        gBenchSink = (long long)sketch.count();
+    };
+    auto keepAll = [&] {
+        if (exact.size() == n) exact.clear();
+        exact.push_back(values[i++ & (n - 1)]);
+    };
+    double sumNs = ns_per_call(sumOnly, 20000000);
+    double sketchNs = ns_per_call(addSketch, 20000000);
+    gBenchSink = (long long)sketch.quantile(0.5);
+    double exactNs = ns_per_call(keepAll, 20000000);
+
+    sketch = QuantileSketch{};
+    for (double v : values) sketch.add(v);
+    std::vector<double> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    auto exact_quantile = [&](double q) {
+        size_t rank = (size_t)std::ceil(q * n);
+        return sorted[std::max<size_t>(rank, 1) - 1];
+    };
+
+    auto querySketch = [&] {
+        gBenchSink = (long long)(sketch.quantile(0.5) + sketch.quantile(0.95) + sketch.quantile(0.99));
+    };
+    std::vector<double> scratch;
+    auto queryExact = [&] {
+        double sum = 0;
+        for (double q : { 0.5, 0.95, 0.99 }) {
+            scratch = values;
+            size_t k = std::max<size_t>((size_t)std::ceil(q * n), 1) - 1;
+            std::nth_element(scratch.begin(), scratch.begin() + k, scratch.end());
+            sum += scratch[k];
+        }
+        gBenchSink = (long long)sum;
+    };
+    QuantileSketch merged;
+    auto mergeSketch = [&] { merged.merge(sketch); gBenchSink = (long long)merged.count(); };
+
+    std::printf("%zu lognormal waits, median 20 s\n", n);
+    std::printf("%-32s %12s %14s\n", "", "ns/update", "bytes");
+    std::printf("%-32s %12.2f %14zu\n", "sum + count (before)", sumNs, sizeof(double) + sizeof(long long));
+    std::printf("%-32s %12.2f %14zu\n", "QuantileSketch::add", sketchNs, sizeof(QuantileSketch));
+    std::printf("%-32s %12.2f %14zu\n", "every value (exact)", exactNs, n * sizeof(double));
+    std::printf("p50+p95+p99 query: sketch %.0f ns, exact (nth_element) %.0f ns\n",
+                ns_per_call(querySketch, 100000), ns_per_call(queryExact, 5));
+    std::printf("merge two sketches: %.0f ns\n", ns_per_call(mergeSketch, 100000));
+    gBenchSink = (long long)merged.quantile(0.5);
+    std::printf("%-6s %12s %12s %10s\n", "", "exact s", "sketch s", "error");
+    for (double q : { 0.5, 0.95, 0.99, 0.999 }) {
+        double want = exact_quantile(q), got = sketch.quantile(q);
+        std::printf("p%-5g %12.4f %12.4f %9.2f%%\n", q * 100, want, got, 100 * (got - want) / want);
+    }
+    return 0;
+}
+
+// Sets up gSim, publishes its first snapshot and starts the simulation
+// thread.
+// `restored`, if given, is moved in instead of a new building and resumes at
+// simulated time `at`.
+void start_simulation(const BuildingParams& bp, unsigned long long seed, double speed,
+                      Journal* journal = nullptr, Simulation* restored = nullptr,
+                      TimePoint at = TimePoint{}) {
+    {
+        std::lock_guard<std::mutex> lock(gMutex);
+        if (restored) gSim = std::move(*restored);
+        else init_building(gSim, bp, seed, 0);
+        gSim.journal = journal;
+        gPacer.reset(speed, at);
+        gStateLog.reset(gSim.stateVersion);
+        publish_snapshots(gSim);
+    }
+    std::thread(sim_loop).detach();
+}
+
+// Ends a process that has started the simulation thread. It and the HTTP
+// threads are detached and never stop, so returning from main would run
+// the static destructors (gSim, gWorkers, the snapshots) underneath them:
+// flush what was printed and leave without them.
+[[noreturn]] void exit_detached(int status) {
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+    std::_Exit(status);
+}
+
+// Closed-loop load against an in-process server on a free port: each of
+// `clients` connections sends `pipeline` GET /state requests, reads all
+// the responses and repeats on the same socket. With keepAlive false every
+// request carries Connection: close and the client reconnects each time;
+// a client answered 503 waits out Retry-After before reconnecting.
+int bench_http(const ServerParams& sp, int clients, double seconds,
+               bool keepAlive, int pipeline, bool conditional) {
+#ifdef __linux__
+    rlimit lim{};
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    socket_t listener = open_listener(0);
+    if (listener == kInvalidSocket) {
+        std::cerr << "cannot open a listening socket\n";
+        return 1;
+    }
+    int port = bound_port(listener);
+    std::thread([=] { serve(listener, sp); }).detach();
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (!keepAlive) pipeline = 1;
+    auto make_batch = [&](const std::string& etag) {
+        std::string request = "GET /state HTTP/1.1\r\nHost: localhost\r\n";
+        if (!etag.empty()) request += "If-None-Match: " + etag + "\r\n";
+        if (!keepAlive) request += "Connection: close\r\n";
+        request += "\r\n";
+        std::string batch;
+        for (int k = 0; k < pipeline; ++k) batch += request;
+        return batch;
+    };
+    const std::string plainBatch = make_batch("");
+
+    struct Client {
+        int fd = -1;
+        size_t sent = 0;
+        int pending = 0;
+        std::string in;
+        std::string batch;
+        std::string etag;   // last one seen, with --if-none-match
+        bool closing = false; // a response said Connection: close
+        bool shed = false;    // ... and was a 503: wait Retry-After first
+    };
+    std::vector<Client> cs(clients);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    long long completed = 0, failed = 0, connects = 0, notModified = 0, shed = 0, bytesIn = 0;
+
+    auto want = [&](int idx, unsigned ev) {
+        epoll_event e{};
+        e.events = ev;
+        e.data.u32 = (unsigned)idx;
+        epoll_ctl(ep, EPOLL_CTL_MOD, cs[idx].fd, &e);
+    };
+    auto connect_client = [&](int idx) {
+        Client& cl = cs[idx];
+        std::string etag = cl.etag;
+        cl = Client{};
+        cl.etag = etag;
+        cl.batch = etag.empty() ? plainBatch : make_batch(etag);
+        cl.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        connect(cl.fd, (sockaddr*)&addr, sizeof(addr));
+        cl.pending = pipeline;
+        epoll_event e{};
+        e.events = EPOLLOUT;
+        e.data.u32 = (unsigned)idx;
+        epoll_ctl(ep, EPOLL_CTL_ADD, cl.fd, &e);
+        connects++;
+    };
+    std::deque<std::pair<WallClock::time_point, int>> backoff; // honouring Retry-After: 1
+    auto reconnect = [&](int idx) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, cs[idx].fd, NULL);
+        close(cs[idx].fd);
+        if (cs[idx].shed) backoff.push_back({ WallClock::now() + std::chrono::seconds(1), idx });
+        else connect_client(idx);
+    };
+
+    for (int i = 0; i < clients; ++i) connect_client(i);
+
+    auto start = WallClock::now();
+    auto stop = start + std::chrono::duration_cast<WallClock::duration>(
+                            std::chrono::duration<double>(seconds));
+    epoll_event events[512];
+    char buf[65536];
+    while (WallClock::now() < stop) {
+        int n = epoll_wait(ep, events, 512, backoff.empty() ? 100 : 10);
+        auto now = WallClock::now();
+        while (!backoff.empty() && backoff.front().first <= now) {
+            connect_client(backoff.front().second);
+            backoff.pop_front();
+        }
+        for (int i = 0; i < n; ++i) {
+            int idx = (int)events[i].data.u32;
+            Client& cl = cs[idx];
+            if (events[i].events & EPOLLERR) { failed++; reconnect(idx); continue; }
+
+            if (cl.sent < cl.batch.size()) {
+                ssize_t put = send(cl.fd, cl.batch.data() + cl.sent, cl.batch.size() - cl.sent,
+                                   MSG_NOSIGNAL);
+                if (put > 0) cl.sent += put;
+                if (cl.sent == cl.batch.size()) want(idx, EPOLLIN);
+                continue;
+            }
+
+            bool eof = false;
+            while (true) {
+                ssize_t got = recv(cl.fd, buf, sizeof(buf), 0);
+                if (got > 0) { cl.in.append(buf, got); bytesIn += got; continue; }
+                if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) eof = true;
+                break;
+            }
+
+            // count complete responses (Content-Length framed; a 304 has no body)
+            while (cl.pending > 0) {
+                size_t end = cl.in.find("\r\n\r\n");
+                if (end == std::string::npos) break;
+                size_t total = end + 4;
+                if (cl.in.compare(9, 3, "304") == 0) {
+                    notModified++;
+                } else {
+                    if (cl.in.compare(9, 3, "503") == 0) { shed++; cl.shed = true; }
+                    size_t cl_at = cl.in.find("Content-Length: ");
+                    if (cl_at == std::string::npos || cl_at > end) break;
+                    total += std::strtoul(cl.in.c_str() + cl_at + 16, nullptr, 10);
+                    if (cl.in.size() < total) break;
+                }
+                size_t close_at = cl.in.find("Connection: close");
+                if (close_at < end) cl.closing = true;
+                if (conditional) {
+                    size_t tag = cl.in.find("ETag: ");
+                    if (tag < end) cl.etag = cl.in.substr(tag + 6, cl.in.find("\r\n", tag) - tag - 6);
+                }
+                cl.in.erase(0, total);
+                cl.pending--;
+                completed++;
+            }
+
+            if (cl.pending == 0 && keepAlive && !eof && !cl.closing) {
+                cl.sent = 0;
+                cl.pending = pipeline;
+                if (conditional) cl.batch = make_batch(cl.etag);
+                want(idx, EPOLLOUT);
+            } else if (eof || (cl.pending == 0 && cl.closing)) {
+                if (cl.pending > 0) failed++;
+                reconnect(idx);
+            }
+        }
+    }
+    double wallSec = std::chrono::duration<double>(WallClock::now() - start).count();
+
+    if (sp.useEpoll)
+        std::printf("epoll, %d server thread(s)", sp.threads);
+    else
+        std::printf("worker pool, %d workers, queue depth %d", sp.workers, sp.queueDepth);
+    std::printf(", %d clients, %s, pipeline %d, %.1f s\n",
+                clients, keepAlive ? "keep-alive" : "Connection: close", pipeline, wallSec);
+    std::printf("%lld responses (%lld failed, %lld not modified, %lld shed with 503) over "
+                "%lld connections: %.0f requests/s served\n",
+                completed, failed, notModified, shed, connects, (completed - shed) / wallSec);
+    std::printf("%.1f bytes received per response; /state bodies serialized: %llu\n",
+                completed ? (double)bytesIn / completed : 0.0, gStateCache.serializations());
+    if (!sp.useEpoll)
+        std::printf("pool: %llu connections served, %llu rejected; queue wait mean %.2f ms, "
+                    "max %.2f ms\n", gWorkers.served(), gWorkers.rejected(),
+                    gWorkers.mean_wait_ms(), gWorkers.max_wait_ms());
+    return 0;
+#else
+    (void)sp; (void)clients; (void)seconds; (void)keepAlive; (void)pipeline;
+    (void)conditional;
+    std::cerr << "--bench http needs Linux (epoll)\n";
+    return 1;
+#endif
+}
+
+int main(int argc, char** argv) {
+    double speed = 1.0;
+    bool batch = false;
+    int days = 1, reps = 0;
+    int port = 8080, clients = 1000, pipeline = 1;
+    bool keepAlive = true, conditional = false;
+    double benchSeconds = 5.0;
+    ServerParams sp;
+    std::string bench;
+    int threads = (int)std::thread::hardware_concurrency();
+    BuildingParams bp;
+    unsigned long long seed = 0;
+    bool seeded = false;
+    JournalParams jp;
+    std::string replay, restorePath, checkpointPath;
+    std::string buildingFlag; // the last flag that set what a checkpoint decides
+
+    // --config first, wherever it is, so flags override the file
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) != "--config") continue;
+        buildingFlag = "--config";
+        std::string error;
+        if (!load_building_config(argv[i + 1], bp, error)) {
+            std::cerr << "config: " << error << "\n";
+            return 1;
+        }
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--speed" && hasValue) {
+            std::string v = argv[++i];
+            speed = (v == "max") ? 0.0 : std::atof(v.c_str());
+        } else if (arg == "--bench" && hasValue) {
+            bench = argv[++i];
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--days" && hasValue) {
+            days = std::atoi(argv[++i]);
+        } else if (arg == "--replications" && hasValue) {
+            reps = std::atoi(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+            seeded = true;
+            buildingFlag = arg;
+        } else if ((arg == "--threads" || arg == "--http-threads") && hasValue) {
+            threads = std::atoi(argv[++i]);
+        } else if (arg == "--port" && hasValue) {
+            port = std::atoi(argv[++i]);
+        } else if (arg == "--io" && hasValue) {
+            sp.useEpoll = std::string(argv[++i]) != "threads";
+        } else if (arg == "--workers" && hasValue) {
+            sp.workers = std::atoi(argv[++i]);
+        } else if (arg == "--queue-depth" && hasValue) {
+            sp.queueDepth = std::atoi(argv[++i]);
+        } else if (arg == "--pipeline" && hasValue) {
+            pipeline = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--close") {
+            keepAlive = false;
+        } else if (arg == "--if-none-match") {
+            conditional = true;
+        } else if (arg == "--clients" && hasValue) {
+            clients = std::atoi(argv[++i]);
+        } else if (arg == "--seconds" && hasValue) {
+            benchSeconds = std::atof(argv[++i]);
+        } else if ((arg == "--floors" || arg == "--cars" || arg == "--capacity" ||
+                    arg == "--start-floors" || arg == "--dispatch") && hasValue) {
+            if (!set_building_param(bp, arg.substr(2), argv[++i])) {
+                std::cerr << "bad " << arg << " '" << argv[i] << "'\n";
+                return 1;
+            }
+            buildingFlag = arg;
+        } else if (arg == "--config" && hasValue) {
+            ++i; // loaded above
+        } else if (arg == "--journal" && hasValue) {
+            jp.path = argv[++i];
+        } else if (arg == "--journal-mmap") {
+            jp.mmap = true;
+        } else if (arg == "--journal-segment-mb" && hasValue) {
+            jp.segmentMB = std::atoi(argv[++i]);
+        } else if (arg == "--replay" && hasValue) {
+            replay = argv[++i];
+        } else if (arg == "--restore" && hasValue) {
+            restorePath = argv[++i];
+        } else if (arg == "--checkpoint" && hasValue) {
+            checkpointPath = argv[++i];
+        } else {
+            std::cerr << "usage: sim_server [--speed N|max] [--seed S] [--dispatch NAME]"
+                         " [--batch --days N [--replications R] [--threads T]]"
+                         " [--floors F] [--cars C] [--capacity K[,K...]]"
+                         " [--start-floors F[,F...]] [--config PATH] [--bench NAME]"
+                         " [--port P] [--io epoll|threads] [--http-threads N]"
+                         " [--workers W] [--queue-depth Q]"
+                         " [--journal PATH [--journal-mmap] [--journal-segment-mb N]]"
+                         " [--replay PATH] [--restore PATH] [--checkpoint PATH]\n";
+            return 1;
+        }
+    }
+    if (!replay.empty()) return replay_journal(replay);
+    std::string buildingError;
+    if (!check_building(bp, buildingError)) {
+        std::cerr << buildingError << "\n";
+        return 1;
+    }
+    if (days < 1) {
+        std::cerr << "days must be >= 1\n";
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (sp.workers < 1 || sp.queueDepth < 0) {
+        std::cerr << "workers must be >= 1 and queue depth >= 0\n";
+        return 1;
+    }
+    sp.threads = threads;
+    if (!make_dispatcher(bp.dispatcher)) {
+        std::cerr << "unknown dispatcher '" << bp.dispatcher << "' (have:";
+        for (const auto& entry : dispatcher_registry()) std::cerr << " " << entry.name;
+        std::cerr << ")\n";
+        return 1;
+    }
+
+    if ((!jp.path.empty() || !restorePath.empty() || !checkpointPath.empty()) &&
+        (reps > 0 || !bench.empty())) {
+        std::cerr << "--journal, --restore and --checkpoint are for one simulation:"
+                     " not with --replications or --bench\n";
+        return 1;
+    }
+
+    if (bench == "calls") return bench_calls();
+    if (!bench.empty() && bench != "fleet" && bench != "dispatch" && bench != "json" &&
+        bench != "http" &&
+        bench != "sketch" && bench != "scale") {
+        std::cerr << "unknown benchmark '" << bench
+                  << "' (have: fleet, calls, dispatch, json, sketch, scale, http)\n";
+        return 1;
+    }
+
+    if (!jp.path.empty() && !restorePath.empty()) {
+        std::cerr << "--journal records a run from its start: not with --restore"
+                     " (a replay could not rebuild the stats before the checkpoint)\n";
+        return 1;
+    }
+    if (!buildingFlag.empty() && !restorePath.empty()) {
+        std::cerr << buildingFlag << " is decided by the checkpoint: not with --restore\n";
+        return 1;
+    }
+
+    // the checkpoint decides the building, dispatcher and seed
+    Simulation restored;
+    TimePoint restoredAt{};
+    if (!restorePath.empty()) {
+        auto started = WallClock::now();
+        std::string bytes, error;
+        if (!read_file(restorePath, bytes, error)) {
+            std::cerr << "restore: " << error << "\n";
+            return 1;
+        }
+        if (!load_checkpoint(bytes, restored, restoredAt, error)) {
+            std::cerr << "restore: " << restorePath << ": " << error << "\n";
+            return 1;
+        }
+        bp.floors = restored.floors;
+        bp.cars = restored.fleet.size();
+        bp.capacities = restored.fleet.capacity;
+        bp.startFloors.clear();
+        bp.dispatcher = restored.dispatcherName;
+        seed = restored.seed;
+        seeded = true;
+        std::cerr << "restored " << restorePath << " (" << bytes.size() << " bytes) at "
+                  << std::chrono::duration<double>(restoredAt.time_since_epoch()).count()
+                  << " simulated s in "
+                  << std::chrono::duration<double, std::milli>(WallClock::now() - started).count()
+                  << " ms\n";
+    }
+
+    if (!seeded) {
+        std::random_device rd;
+        seed = ((unsigned long long)rd() << 32) | rd();
+    }
+    std::cerr << "seed: " << seed << "\n";
+
+    if (bench == "fleet") return bench_fleet(bp, days, seed);
+    if (bench == "dispatch") return bench_dispatch(bp, days, seed);
+    if (bench == "json") return bench_json(bp, days, seed);
+    if (bench == "scale") return bench_scale(bp, days, seed);
+    if (bench == "sketch") return bench_sketch(seed);
+
+    if (batch && reps > 0)
+        return run_replications(bp, days, reps, std::min(threads, reps), seed);
+    if (batch)
+        return run_batch(bp, days, seed, jp, restorePath.empty() ? nullptr : &restored,
+                         checkpointPath);
+
+    if (!net_startup()) return 1;
+    Journal* journal = nullptr; // never freed: the simulation thread outlives main's scope
+    if (!jp.path.empty()) {
+        journal = new Journal;
+        if (!journal->open(jp, journal_header(bp, seed))) return 1;
+    }
+    if (!checkpointPath.empty()) gCheckpointPath = checkpointPath;
+    start_simulation(bp, seed, speed, journal, restorePath.empty() ? nullptr : &restored,
+                     restoredAt);
+
+    if (bench == "http")
+        exit_detached(bench_http(sp, clients, benchSeconds, keepAlive, pipeline, conditional));
+
+    socket_t s = open_listener(port);
+    if (s == kInvalidSocket) {
+        std::cerr << "cannot listen on port " << port << "\n";
+        exit_detached(1);
+    }
+
+    std::cout << "Sim server at http://localhost:" << port << "\n";
+    serve(s, sp);
+
+    close_socket(s);
+    net_cleanup();
+    exit_detached(0);
 }
@@ -26,7 +26,7 @@ class LoginActivity : AppCompatActivity() {
 
             lifecycleScope.launch {
                 try {
-                    val state = withContext(Dispatchers.IO) { SimApi.api.getState() }
+                    val state = withContext(Dispatchers.IO) { SimApi.api.getState().state }
                     val floors = state.floorCount
 
                     tvStatus.text = "Connected — $floors floors detected."
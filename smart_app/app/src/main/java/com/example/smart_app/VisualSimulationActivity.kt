@@ -97,10 +97,14 @@ class VisualSimulationActivity : AppCompatActivity() {
         pollingJob = lifecycleScope.launch(Dispatchers.IO) {
             while (isActive) {
                 try {
-                    val state = SimApi.api.getState()
+                    val update = SimApi.api.getState()
+                    val state = update.state
                     val nowMs = SystemClock.elapsedRealtime()
 
                     withContext(Dispatchers.Main) {
+                        // 304: nothing changed, the tracks keep extrapolating
+                        if (update.notModified && initializedLayout) return@withContext
+
                         if (!initializedLayout || state.floorCount != floorCount) {
                             floorCount = state.floorCount
                             buildFloorLabels()
@@ -114,7 +118,7 @@ class VisualSimulationActivity : AppCompatActivity() {
                         // Update movement tracks from server truth
                         latestStates.forEachIndexed { idx, e ->
                             if (idx >= tracks.size) return@forEachIndexed
-                            updateTrackFromServer(idx, e, nowMs)
+                            updateTrackFromServer(idx, e, update.ageMs, nowMs)
                         }
                     }
                 } catch (_: Exception) {
@@ -126,8 +130,10 @@ class VisualSimulationActivity : AppCompatActivity() {
         }
     }
 
-    private fun updateTrackFromServer(i: Int, e: ElevatorState, nowMs: Long) {
+    // ageMs: simulated ms since e.remainingMs was current (StateUpdate)
+    private fun updateTrackFromServer(i: Int, e: ElevatorState, ageMs: Long, nowMs: Long) {
         val t = tracks[i]
+        val remainingNow = (e.remainingMs - ageMs).coerceAtLeast(0L)
 
         when (e.state) {
             "Moving" -> {
@@ -139,11 +145,11 @@ class VisualSimulationActivity : AppCompatActivity() {
                     t.startFloor = e.currentFloor
                     t.targetFloor = e.targetFloor
                     t.totalTripMs = e.remainingMs
-                    t.remainingMsReported = e.remainingMs
+                    t.remainingMsReported = remainingNow
                     t.lastServerUpdateMs = nowMs
                 } else {
                     // continuing same trip: just refresh remainingMs/time anchor
-                    t.remainingMsReported = e.remainingMs
+                    t.remainingMsReported = remainingNow
                     t.lastServerUpdateMs = nowMs
 
                     // If server says remaining grew (rare), treat as new trip
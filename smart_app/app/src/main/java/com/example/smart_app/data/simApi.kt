@@ -1,13 +1,17 @@
 package com.example.smart_app.data
 
+import retrofit2.HttpException
+import retrofit2.Response
 import retrofit2.Retrofit
 import retrofit2.converter.gson.GsonConverterFactory
 import retrofit2.http.GET
+import retrofit2.http.Header
 
 // ---------- STATE RESPONSE (/state) ----------
 
 data class StateResponse(
     val floorCount: Int,
+    val asOfMs: Long, // simulated time remainingMs count from
     val elevators: List<ElevatorState>
 )
 
@@ -58,13 +62,55 @@ data class HourlyStats(
 // ---------- RETROFIT SERVICE ----------
 
 interface SimService {
+    // 304 Not Modified (no body) while etag still matches the server's
     @GET("state")
-    suspend fun getState(): StateResponse
+    suspend fun getState(@Header("If-None-Match") etag: String?): Response<StateResponse>
 
     @GET("stats/daily")
     suspend fun getStats(): StatsResponse
 }
 
+// ---------- CONDITIONAL /state CLIENT ----------
+
+// One /state poll. ageMs is how much simulated time has passed since
+// `state` was current (X-Sim-Time-Ms - asOfMs), so a car's remainingMs is
+// now remainingMs - ageMs. notModified: the server answered 304 and
+// `state` is the body of an earlier poll.
+data class StateUpdate(
+    val state: StateResponse,
+    val ageMs: Long,
+    val notModified: Boolean
+)
+
+// Remembers the last /state body and its ETag and revalidates with
+// If-None-Match, so polling an idle fleet downloads headers only.
+class SimClient(private val service: SimService) {
+    private class Cached(val etag: String, val state: StateResponse)
+
+    @Volatile
+    private var cached: Cached? = null
+
+    suspend fun getState(): StateUpdate {
+        val last = cached
+        val response = service.getState(last?.etag)
+        if (response.code() == 304 && last != null)
+            return StateUpdate(last.state, ageMs(response, last.state), notModified = true)
+        if (!response.isSuccessful) throw HttpException(response)
+
+        val state = response.body() ?: throw HttpException(response)
+        val etag = response.headers()["ETag"]
+        cached = if (etag != null) Cached(etag, state) else null
+        return StateUpdate(state, ageMs(response, state), notModified = false)
+    }
+
+    private fun ageMs(response: Response<*>, state: StateResponse): Long {
+        val simNowMs = response.headers()["X-Sim-Time-Ms"]?.toLongOrNull() ?: return 0L
+        return (simNowMs - state.asOfMs).coerceAtLeast(0L)
+    }
+
+    suspend fun getStats(): StatsResponse = service.getStats()
+}
+
 // ---------- FACTORY + SINGLETON ----------
 
 object SimApi {
@@ -79,5 +125,5 @@ object SimApi {
         return retrofit.create(SimService::class.java)
     }
 
-    val api: SimService by lazy { create(BASE_URL) }
+    val api: SimClient by lazy { SimClient(create(BASE_URL)) }
 }
\ No newline at end of file